@@ -26,6 +26,7 @@
 #include <assert.h>
 #include <err.h>
 #include <limits.h>
+#include <stdint.h>
 #include <ctype.h>
 
 struct row {
@@ -55,6 +56,17 @@ struct buffer {
 	char *kill;
 	size_t kill_used;
 	size_t kill_size;
+
+	/*
+	 * While inserting, updates are merged into one range that is
+	 * broadcast at the end.
+	 */
+	int batch;
+	int batch_from;
+	int batch_to;
+
+	/* Bytes allocated for rows and their contents. */
+	size_t memory;
 };
 
 static int	 buffer_insert_row(struct buffer *, int);
@@ -117,6 +129,26 @@ buffer_is_marked(struct buffer *buffer, size_t row, size_t offset,
 		return 0;
 }
 
+/*
+ * Returns 1 and sets the marked byte range [from, to) within the row if
+ * any part of the row is marked. 'to' is SIZE_MAX if the mark continues
+ * past the end of row. Same rules as in buffer_is_marked().
+ */
+int
+buffer_marked_range(struct buffer *buffer, size_t row, size_t dot_row,
+    size_t dot_offset, size_t *from, size_t *to)
+{
+	if (buffer->has_mark == 0)
+		return 0;
+	else if (buffer->mark.row > row || dot_row < row)
+		return 0;
+
+	*from = (buffer->mark.row == row) ? buffer->mark.offset : 0;
+	*to = (dot_row == row) ? dot_offset : SIZE_MAX;
+
+	return (*from < *to);
+}
+
 /*
  * -1 less than
  * 0 equal
@@ -407,6 +439,13 @@ buffer_set_row_uflags(struct buffer *buffer, int row, int uflags)
 	buffer->rows[row].uflags = uflags;
 }
 
+size_t
+buffer_memory(
+	struct buffer *buffer)
+{
+	return buffer->memory;
+}
+
 size_t
 buffer_rows(
 	struct buffer *buffer)
@@ -426,6 +465,7 @@ buffer_clear_row(
 	if (row >= buffer->n_rows)
 		return;
 
+	buffer->memory -= buffer->rows[row].bytes_size;
 	buffer->rows[row].bytes_used = 0;
 	buffer->rows[row].bytes_size = 0;
 	if (buffer->rows[row].bytes != NULL) {
@@ -464,11 +504,12 @@ buffer_u8str_at(struct buffer *buffer, size_t row, size_t *sz_out)
  *
  * Otherwise returns buffer containing string parsed so far. If error
  * is set then the last character in the returned string should be replaced
- * with a replacement character U+FFFD.
+ * with a replacement character U+FFFD. At most about 'max' bytes are
+ * parsed at a time, but characters are kept whole.
  */
 const char *
 buffer_u8str_break(struct buffer *buffer, size_t row, size_t *offset,
-    size_t *sz_out, int *error)
+    size_t max, size_t *sz_out, int *error)
 {
 	size_t begin;
 	struct row *rowptr;
@@ -487,8 +528,8 @@ buffer_u8str_break(struct buffer *buffer, size_t row, size_t *offset,
 		return NULL;
 
 	begin = *offset;
-	while(utf8_incr_col(rowptr->bytes, rowptr->bytes_used,
-	    offset, error) > 0 && *error == 0)
+	while(*offset - begin < max && utf8_incr_col(rowptr->bytes,
+	    rowptr->bytes_used, offset, error) > 0 && *error == 0)
 		;
 
 	if (*offset == begin)
@@ -521,6 +562,7 @@ buffer_clear(struct buffer *buffer)
 		free(buffer->rows);
 		buffer->rows = NULL;
 	}
+	buffer->memory -= buffer->max_rows * sizeof(*buffer->rows);
 	buffer->max_rows = 0;
 
 	buffer_clear_mark(buffer, 0);
@@ -616,9 +658,14 @@ buffer_insert_row(struct buffer *buffer, int row)
 	assert(buffer != NULL);
 
 	if (buffer->n_rows == buffer->max_rows) {
+		buffer->memory -= buffer->max_rows * sizeof(*buffer->rows);
 		if (grow_array((void **) &buffer->rows,
-		    sizeof(*buffer->rows), &buffer->max_rows) == -1)
+		    sizeof(*buffer->rows), &buffer->max_rows) == -1) {
+			buffer->memory += buffer->max_rows *
+			    sizeof(*buffer->rows);
 			return -1;
+		}
+		buffer->memory += buffer->max_rows * sizeof(*buffer->rows);
 	}
 
 	if (row < buffer->n_rows) {
@@ -742,35 +789,30 @@ buffer_update_cursor(struct buffer *buffer, struct cursor *cursor,
 }
 
 static int
-buffer_make_space(struct row *rowptr, size_t offset, size_t sz)
+buffer_make_space(struct buffer *buffer, struct row *rowptr, size_t offset,
+    size_t sz)
 {
-	void *dst, *src;
-	size_t len;
-
-	while (sz > 0 && sz--) {
-		if (rowptr->bytes_used == rowptr->bytes_size)
-			if (grow_array((void **) &rowptr->bytes,
-			    sizeof(*rowptr->bytes), &rowptr->bytes_size)
-			    == -1)
-				return -1;
+	size_t old_size;
 
-		rowptr->bytes_used++;
-
-		if (offset+1 < rowptr->bytes_used) {
-			dst = &rowptr->bytes[offset+1];
-			src = &rowptr->bytes[offset];
-			len = (rowptr->bytes_used-offset) *
-			    sizeof(*rowptr->bytes);
-			memmove(dst, src, len);
+	old_size = rowptr->bytes_size;
+	while (rowptr->bytes_used + sz > rowptr->bytes_size)
+		if (grow_array((void **) &rowptr->bytes,
+		    sizeof(*rowptr->bytes), &rowptr->bytes_size) == -1) {
+			buffer->memory += rowptr->bytes_size - old_size;
+			return -1;
 		}
+	buffer->memory += rowptr->bytes_size - old_size;
 
-		offset++;
-	}
+	if (offset < rowptr->bytes_used)
+		memmove(&rowptr->bytes[offset+sz], &rowptr->bytes[offset],
+		    (rowptr->bytes_used-offset) * sizeof(*rowptr->bytes));
+	rowptr->bytes_used += sz;
 	return 0;
 }
 
 static int
-buffer_shrink_space(struct row *rowptr, size_t offset, size_t sz)
+buffer_shrink_space(struct buffer *buffer, struct row *rowptr, size_t offset,
+    size_t sz)
 {
 	void *dst, *src;
 	size_t len;
@@ -787,6 +829,7 @@ buffer_shrink_space(struct row *rowptr, size_t offset, size_t sz)
 	}
 	if (rowptr->bytes_used == 0 && rowptr->bytes != NULL) {
 		free(rowptr->bytes);
+		buffer->memory -= rowptr->bytes_size;
 		rowptr->bytes_size = 0;
 		rowptr->bytes = NULL;
 	}
@@ -812,18 +855,16 @@ buffer_insert_char(struct buffer *buffer, size_t row, size_t *offset,
 	rowptr = &buffer->rows[row];
 	assert(rowptr != NULL);
 
-	if (buffer_make_space(rowptr, *offset, len) == -1)
+	if (buffer_make_space(buffer, rowptr, *offset, len) == -1)
 		return -1;
 
 	o_offset = *offset;
-	while (len > 0 && len--) {
-		rowptr->bytes[*offset] = *s++;
-		(*offset)++;
-	}
+	memcpy(&rowptr->bytes[*offset], s, len);
+	*offset += len;
 
 	if (buffer->has_mark && buffer->mark.row == row)
 		if (o_offset < buffer->mark.offset)
-			buffer_update_cursor(buffer, &buffer->mark, 0, 1);
+			buffer->mark.offset += len;
 
 	return 0;
 }
@@ -835,6 +876,19 @@ broadcast_update(struct buffer *buffer,
 {
 	size_t i;
 
+	if (buffer->batch) {
+		if (buffer->batch_from == -1) {
+			buffer->batch_from = MIN(from_row, to_row);
+			buffer->batch_to = MAX(from_row, to_row);
+		} else {
+			buffer->batch_from = MIN(buffer->batch_from,
+			    MIN(from_row, to_row));
+			buffer->batch_to = MAX(buffer->batch_to,
+			    MAX(from_row, to_row));
+		}
+		return;
+	}
+
 	for (i = 0; i < buffer->n_listeners; i++)
 		buffer->listeners[i].callback(from_row, from_col, to_row,
 		    to_col, type, buffer->listeners[i].udata);
@@ -852,6 +906,7 @@ buffer_remove_row(struct buffer *buffer, int row)
 
 	if (buffer->rows[row].bytes != NULL)
 		free(buffer->rows[row].bytes);
+	buffer->memory -= buffer->rows[row].bytes_size;
 
 	if (row+1 < buffer->n_rows) {
 		dst = &buffer->rows[row];
@@ -947,7 +1002,7 @@ buffer_delete_char(struct buffer *buffer, struct cursor *cursor)
 	rowptr = &buffer->rows[cursor->row];
 	p = row_at(rowptr, &offset, &sz);
 	if (p != NULL)
-		if (buffer_shrink_space(rowptr, cursor->offset, sz) == -1)
+		if (buffer_shrink_space(buffer, rowptr, cursor->offset, sz) == -1)
 			return;
 
 	broadcast_update(cursor->buffer, cursor->row, cursor->col,
@@ -970,56 +1025,97 @@ buffer_erase(struct buffer *buffer, struct cursor *cursor)
 int
 buffer_insert(struct cursor *cursor, const char *s, size_t len)
 {
-	int row, col;
-	int from_row, from_col;
+	return buffer_insert_lines(cursor, s, len, NULL, 0);
+}
+
+/*
+ * Like buffer_insert, but with offsets of the line breaks in 's'
+ * already known, or searched for if 'ends' is NULL.
+ */
+int
+buffer_insert_lines(struct cursor *cursor, const char *s, size_t len,
+    const size_t *ends, size_t nends)
+{
+	int from_row, ret;
 	struct buffer *buffer = cursor->buffer;
-	unsigned char ch;
-	char *p;
+	struct row *prev;
+	const char *nl;
 	size_t offset, offset2;
-	size_t sz;
+	size_t n, pos, k;
 
-	row = from_row = CURSOR_ROW(cursor);
-	col = from_col = CURSOR_COL(cursor);
+	from_row = CURSOR_ROW(cursor);
 
 	if (buffer->n_rows == 0)
 		if (buffer_insert_row(buffer, 0) == -1)
 			return -1;
 
-	offset = cursor->offset;
+	buffer->batch = 1;
+	buffer->batch_from = -1;
+	ret = 0;
 
-	while (len > 0 && len--) {
-		ch = (unsigned char) *s;
-		if (ch == '\n') {
-			cursor->offset = offset;
+	/*
+	 * Text between newlines is inserted in one go, which matters
+	 * when a pty delivers a large batch of output.
+	 */
+	offset = cursor->offset;
+	pos = k = 0;
+	while (len > 0) {
+		if (ends != NULL)
+			n = k < nends ? ends[k++] - pos : len;
+		else if ((nl = memchr(s, '\n', len)) != NULL)
+			n = nl - s;
+		else
+			n = len;
+
+		if (n > 0 && buffer_insert_char(buffer, cursor->row,
+		    &offset, s, n) == -1) {
+			ret = -1;
+			break;
+		}
+		s += n;
+		len -= n;
+		pos += n;
+		if (len == 0)
+			break;
 
-			if (buffer_insert_row(buffer, cursor->row+1) == -1)
-				return -1;
-			cursor->row++;
+		/*
+		 * Move the rest of the row after the cursor to a new row.
+		 */
+		cursor->offset = offset;
 
-			offset2 = 0;
-			while ((p = row_at(&buffer->rows[cursor->row-1],
-			    &offset, &sz)) != NULL)
-				buffer_insert_char(buffer, cursor->row,
-				    &offset2, p, sz);
+		if (buffer_insert_row(buffer, cursor->row+1) == -1) {
+			ret = -1;
+			break;
+		}
+		cursor->row++;
+
+		prev = &buffer->rows[cursor->row-1];
+		offset2 = 0;
+		if (prev->bytes_used > offset &&
+		    buffer_insert_char(buffer, cursor->row, &offset2,
+		    &prev->bytes[offset], prev->bytes_used - offset) == -1) {
+			ret = -1;
+			break;
+		}
 
-			buffer_erase_eol_at(buffer, cursor->row-1,
-			    cursor->offset);
+		buffer_erase_eol_at(buffer, cursor->row-1,
+		    cursor->offset);
 
-			cursor->col = 0;
-			cursor->offset = 0;
-			offset = 0;
-		} else {
-			if (buffer_insert_char(cursor->buffer, cursor->row,
-			    &offset, &ch, 1) == -1)
-				return -1;
-		}
+		cursor->col = 0;
+		cursor->offset = 0;
+		offset = 0;
 		s++;
+		len--;
+		pos++;
 	}
 	cursor->offset = offset;
 
-	broadcast_update(cursor->buffer,
-	    from_row, 0, cursor->row, 0, BUFFER_UPDATE_LINE);
-	return 0;
+	broadcast_update(buffer, from_row, 0, cursor->row, 0,
+	    BUFFER_UPDATE_LINE);
+	buffer->batch = 0;
+	broadcast_update(buffer, buffer->batch_from, 0, buffer->batch_to, 0,
+	    BUFFER_UPDATE_LINE);
+	return ret;
 }
 
 #if 0
@@ -58,6 +58,8 @@ void		 buffer_cursor_free(struct cursor *);
 
 /* offset = buffer_insert(cursor, str, len) */
 int		 buffer_insert(struct cursor *, const char *, size_t);
+int		 buffer_insert_lines(struct cursor *, const char *, size_t,
+		    const size_t *, size_t);
 
 void		 buffer_erase(struct buffer *, struct cursor *);
 void		 buffer_delete_char(struct buffer *, struct cursor *);
@@ -68,6 +70,8 @@ void		 buffer_set_mark(struct buffer *, size_t, size_t);
 void		 buffer_clear_mark(struct buffer *, size_t);
 int		 buffer_is_marked(struct buffer *, size_t, size_t, size_t,
 		    size_t);
+int		 buffer_marked_range(struct buffer *, size_t, size_t, size_t,
+		    size_t *, size_t *);
 int		 buffer_has_mark(struct buffer *);
 
 void		 buffer_kill_region(struct buffer *, struct cursor *);
@@ -87,6 +91,7 @@ size_t
 buffer_offset(struct buffer *buffer, size_t row, size_t col);
 
 size_t		 buffer_rows(struct buffer *);
+size_t		 buffer_memory(struct buffer *);
 
 #if 0
 /* buffer_at(buffer, row, skip, offset, sz_out) */
@@ -105,9 +110,10 @@ buffer_bytes_at(struct buffer *buffer, size_t row);
 /* buffer_u8str_at(buffer, row, sz_out) */
 const char	*buffer_u8str_at(struct buffer *, size_t, size_t *);
 
+/* buffer_u8str_break(buffer, row, offset, max, sz_out, error) */
 const char *
 buffer_u8str_break(struct buffer *buffer, size_t row, size_t *offset,
-    size_t *sz_out, int *error);
+    size_t max, size_t *sz_out, int *error);
 
 int
 buffer_match(struct buffer *buffer, size_t row, const char *needle,
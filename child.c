@@ -0,0 +1,188 @@
+/*
+ * vtsh - A mashup of virtual terminal and shell
+ * Copyright (c) 2022, Tommi Leino <namhas@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * child.c: Reaps child processes as they exit without ever blocking.
+ * SIGCHLD is turned into an event source, with signalfd(2) where
+ * available and a self-pipe elsewhere, and all exited children are
+ * collected with wait4(2) when it becomes readable.
+ */
+
+#ifdef __linux__
+#define _DEFAULT_SOURCE		/* wait4 */
+#endif
+
+#include "child.h"
+#include "event.h"
+#include "util.h"
+
+#include <sys/wait.h>
+
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+
+#ifdef HAVE_SIGNALFD
+#include <sys/signalfd.h>
+#endif
+
+struct child {
+	pid_t		 pid;
+	ChildExit	 callback;
+	void		*udata;
+};
+
+static struct child	*children;
+static size_t		 n_children;
+static size_t		 max_children;
+
+static int		 sigfd = -1;
+#ifndef HAVE_SIGNALFD
+static int		 sigpipe[2] = { -1, -1 };
+#endif
+
+static void		 child_reap(int, void *);
+#ifndef HAVE_SIGNALFD
+static void		 child_sigchld(int);
+#endif
+
+/*
+ * Must be called before forking the first child, so that no SIGCHLD
+ * gets lost.
+ */
+void
+child_init(void)
+{
+#ifdef HAVE_SIGNALFD
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+		err(1, "sigprocmask");
+	if ((sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1)
+		err(1, "signalfd");
+#else
+	struct sigaction sa;
+	int i;
+
+	if (pipe(sigpipe) == -1)
+		err(1, "pipe");
+	for (i = 0; i < 2; i++)
+		if (fcntl(sigpipe[i], F_SETFL, O_NONBLOCK) == -1 ||
+		    fcntl(sigpipe[i], F_SETFD, FD_CLOEXEC) == -1)
+			err(1, "fcntl");
+	sigfd = sigpipe[0];
+
+	sa.sa_handler = child_sigchld;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	if (sigaction(SIGCHLD, &sa, NULL) == -1)
+		err(1, "sigaction");
+#endif
+
+	if (add_event_source(sigfd, child_reap, NULL) == -1)
+		err(1, "add_event_source");
+}
+
+/*
+ * Undoes child_init() in a forked child before it executes a program.
+ */
+void
+child_reset_signals(void)
+{
+#ifdef HAVE_SIGNALFD
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_UNBLOCK, &mask, NULL);
+#else
+	signal(SIGCHLD, SIG_DFL);
+#endif
+}
+
+#ifndef HAVE_SIGNALFD
+static void
+child_sigchld(int signo)
+{
+	int saved_errno = errno;
+
+	write(sigpipe[1], "", 1);
+	errno = saved_errno;
+}
+#endif
+
+/*
+ * Calls 'callback' once 'pid' has exited. Children that are not
+ * watched, or no longer, are reaped silently.
+ */
+int
+child_watch(pid_t pid, ChildExit callback, void *udata)
+{
+	if (n_children == max_children)
+		if (grow_array((void **) &children, sizeof(*children),
+		    &max_children) == -1)
+			return -1;
+
+	children[n_children++] = (struct child) { pid, callback, udata };
+	return 0;
+}
+
+void
+child_unwatch(pid_t pid)
+{
+	size_t i;
+
+	for (i = 0; i < n_children; i++)
+		if (children[i].pid == pid) {
+			children[i] = children[--n_children];
+			return;
+		}
+}
+
+static void
+child_reap(int fd, void *udata)
+{
+	char buf[128];
+	struct rusage rusage;
+	struct child child;
+	pid_t pid;
+	size_t i;
+	int status;
+
+	/*
+	 * Signals are merged, so this only tells that some children may
+	 * have exited.
+	 */
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+
+	while ((pid = wait4(-1, &status, WNOHANG, &rusage)) > 0) {
+		for (i = 0; i < n_children; i++)
+			if (children[i].pid == pid)
+				break;
+		if (i == n_children)
+			continue;
+
+		child = children[i];
+		children[i] = children[--n_children];
+		child.callback(pid, status, &rusage, child.udata);
+	}
+}
@@ -0,0 +1,32 @@
+/*
+ * vtsh - A mashup of virtual terminal and shell
+ * Copyright (c) 2022, Tommi Leino <namhas@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CHILD_H
+#define CHILD_H
+
+#include <sys/types.h>
+#include <sys/resource.h>
+
+/* callback(pid, status, rusage, udata) */
+typedef void (*ChildExit)(pid_t, int, struct rusage *, void *);
+
+void	 child_init(void);
+void	 child_reset_signals(void);
+int	 child_watch(pid_t, ChildExit, void *);
+void	 child_unwatch(pid_t);
+
+#endif
@@ -18,30 +18,70 @@
 #include "color.h"
 #include "dpy.h"
 
+#include <X11/Xft/Xft.h>
+
 #include <assert.h>
 #include <err.h>
 
 static XColor color[NUM_COLOR];
-static int has_color[NUM_COLOR];
+static XftColor xftcolor[NUM_COLOR];
+static int has_colors;
 
 #include "colornames.c"
 
+/*
+ * Allocates every color at once. Colors are defined in hex so that
+ * XParseColor() does not need to look them up from the server, and on
+ * TrueColor visuals XftColorAllocValue() computes the pixel values on
+ * the client side. Thus there are no round trips unless the visual has
+ * a writable colormap.
+ */
+void
+color_init(struct dpy *dpy)
+{
+	Visual *visual;
+	Colormap colormap;
+	XRenderColor value;
+	int i;
+
+	visual = DefaultVisual(DPY(dpy), DPY_SCREEN(dpy));
+	colormap = DefaultColormap(DPY(dpy), DPY_SCREEN(dpy));
+
+	for (i = 0; i < NUM_COLOR; i++) {
+		if (XParseColor(DPY(dpy), colormap, colorname[i],
+		    &color[i]) == 0)
+			errx(1, "couldn't parse '%s'", colorname[i]);
+
+		value.red = color[i].red;
+		value.green = color[i].green;
+		value.blue = color[i].blue;
+		value.alpha = 0xffff;
+		if (XftColorAllocValue(DPY(dpy), visual, colormap, &value,
+		    &xftcolor[i]) == False)
+			errx(1, "couldn't allocate '%s'", colorname[i]);
+
+		color[i].pixel = xftcolor[i].pixel;
+	}
+
+	has_colors = 1;
+}
+
 XColor
 query_color(struct dpy *dpy, int i)
 {
-	XColor def, exact;
-
 	assert(i < NUM_COLOR);
 
-	if (has_color[i])
-		return color[i];
+	if (!has_colors)
+		color_init(dpy);
 
-	if (XAllocNamedColor(DPY(dpy), XDefaultColormap(DPY(dpy),
-	    DPY_SCREEN(dpy)), colorname[i], &def, &exact) == 0)
-		errx(1, "couldn't allocate '%s'", colorname[i]);
+	return color[i];
+}
 
-	color[i] = def;
-	has_color[i] = 1;
+XftColor *
+color_xft(int i)
+{
+	assert(i < NUM_COLOR);
+	assert(has_colors);
 
-	return color[i];
+	return &xftcolor[i];
 }
@@ -21,9 +21,12 @@
 #include "colornames.h"
 
 #include <X11/Xlib.h>
+#include <X11/Xft/Xft.h>
 
 struct dpy;
 
-XColor query_color(struct dpy *, int);
+void		 color_init(struct dpy *);
+XColor		 query_color(struct dpy *, int);
+XftColor	*color_xft(int);
 
 #endif
@@ -0,0 +1,21 @@
+/* Generated on Sun Oct 18 09:34:13 UTC 2026 using 'mkenum' */
+static const char *colorname[] = {
+	"#f5efe0",
+	"#000000",
+	"#ff0000",
+	"#ffa500",
+	"#00ff00",
+	"#a020f0",
+	"#ffff00",
+	"#bebebe",
+	"#00ff00",
+	"#bebebe",
+	"#6495ed",
+	"#ffffff",
+	"#ffffff",
+	"#a020f0",
+	"#0000ff",
+	"#0000ff",
+	"#ff0000",
+	"#0000ff",
+};
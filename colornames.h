@@ -0,0 +1,25 @@
+/* Generated on Sun Oct 18 09:34:13 UTC 2026 using 'mkenum' */
+#ifndef COLOR_NAMES_H
+#define COLOR_NAMES_H
+enum color {
+	COLOR_TEXT_BG,
+	COLOR_TEXT_FG,
+	COLOR_TEXT_CURSOR,
+	COLOR_TEXT_SELECTION,
+	COLOR_TEXT_OUTPUT_CURSOR,
+	COLOR_TEXT_CTRL,
+	COLOR_TEXT_SEARCH,
+	COLOR_TEXT_LINENO,
+	COLOR_TEXT_BOTTOM_ROW,
+	COLOR_TITLE_BG_NORMAL,
+	COLOR_TITLE_BG_FOCUS,
+	COLOR_TITLE_FG_NORMAL,
+	COLOR_MENU_FG_NORMAL,
+	COLOR_MENU_FG_FOCUS,
+	COLOR_MENU_FG_HIGHLIGHT,
+	COLOR_FLAGS,
+	COLOR_FOCUS_BORDER,
+	COLOR_NORMAL_BORDER,
+	NUM_COLOR
+};
+#endif
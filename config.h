@@ -67,4 +67,137 @@
  */
 #define KILL_BUFFER_CHUNK 4096
 
+/*
+ * HSCROLL_STEP:
+ *   Horizontal scroll step in pixels when cursor moves out of view.
+ *   Finer step is nicer for browsing wide tables and logs. By default,
+ *   half of the window width is scrolled at a time.
+ */
+/* #define HSCROLL_STEP 64 */
+
+/*
+ * FRAME_INTERVAL_MS:
+ *   Minimum time between redraws when output is flooding in, roughly
+ *   the display refresh interval. Damage is gathered in between so
+ *   that frames that would be overdrawn are never sent. Keyboard echo
+ *   is always drawn immediately.
+ */
+#define FRAME_INTERVAL_MS 16
+
+/*
+ * EVENT_BYTE_BUDGET, EVENT_SOURCE_MS, EVENT_ITERATION_MS:
+ *   How much a single flooding source such as a pty may read, and for
+ *   how long, before the next ready source gets its turn, and how long
+ *   one round of sources may take before drawing and X input are given
+ *   a chance. Sources left over are served first on the next round.
+ */
+#define EVENT_BYTE_BUDGET (64 * 1024)
+#define EVENT_SOURCE_MS 4
+#define EVENT_ITERATION_MS 16
+
+/*
+ * TASK_SLICE_MS:
+ *   How long a task such as loading a file may run before yielding,
+ *   and the time all background tasks share per event loop iteration.
+ */
+#define TASK_SLICE_MS 8
+
+/*
+ * STATBAR_INTERVAL_MS:
+ *   Minimum time between status bar redraws, which also is the period
+ *   over which throughput is measured.
+ */
+#define STATBAR_INTERVAL_MS 250
+
+/*
+ * PTY_PAUSE_MEMORY:
+ *   Buffer memory in bytes above which output of a command is no longer
+ *   read, which makes the command block once the pty is full. Pressing
+ *   End in the output doubles the limit and continues.
+ */
+#define PTY_PAUSE_MEMORY (256 * 1024 * 1024)
+
+/*
+ * PTY_PAUSE_ROWS:
+ *   Reading is paused likewise when the view has been scrolled up and
+ *   is this many rows behind the end of output, until the view is
+ *   scrolled back to the end.
+ */
+#define PTY_PAUSE_ROWS 100000
+
+/*
+ * PTY_RESUME_MS:
+ *   How often a view paused behind the output is checked for having
+ *   been scrolled back to the end.
+ */
+#define PTY_RESUME_MS 100
+
+/*
+ * PTY_INPUT_RETRY_MS:
+ *   How often input that did not fit in the pty is retried while the
+ *   command is not reading it.
+ */
+#define PTY_INPUT_RETRY_MS 10
+
+/*
+ * PTY_READ_SIZE:
+ *   Size of a single read from a pty. A larger one does not help, as
+ *   e.g. Linux returns at most 4095 bytes per read from a pty, and it
+ *   should stay well below EVENT_BYTE_BUDGET, which is only checked
+ *   between reads.
+ */
+#define PTY_READ_SIZE 8192
+
+/*
+ * WANT_READER_THREADS:
+ *   Read each pty in a thread of its own that also splits the output
+ *   to lines, leaving the main thread only inserting and drawing.
+ *   Rerun configure after changing this.
+ */
+/* #define WANT_READER_THREADS */
+
+/*
+ * ROWCACHE_MAX_BYTES:
+ *   Upper limit for memory used by rendered rows kept in the row cache,
+ *   counting the off-screen pixmaps.
+ */
+#define ROWCACHE_MAX_BYTES (16 * 1024 * 1024)
+
+/*
+ * ROWCACHE_MAX_ROW_BYTES:
+ *   Rows longer than this are always drawn directly because hashing and
+ *   comparing them would cost more than drawing.
+ */
+#define ROWCACHE_MAX_ROW_BYTES 1024
+
+/*
+ * HINDEX_MIN_ROW_BYTES:
+ *   Rows longer than this get an index of pixel positions so that
+ *   drawing and hit-testing start near the visible part of the row.
+ */
+#define HINDEX_MIN_ROW_BYTES 4096
+
+/*
+ * HINDEX_INTERVAL:
+ *   How many characters there are between indexed positions.
+ */
+#define HINDEX_INTERVAL 256
+
+/*
+ * WANT_SOFT_WRAP:
+ *   Start editors in soft-wrap mode where long rows continue on the
+ *   next display line instead of scrolling horizontally. The mode can
+ *   be toggled with C-x w.
+ */
+/* #define WANT_SOFT_WRAP */
+
+/*
+ * WANT_SHM_RENDER:
+ *   Rasterize text on the client side into an MIT-SHM image when the
+ *   whole editor view is repainted, and send it with a single request.
+ *   Falls back to Xft if MIT-SHM is not available, e.g. on a remote
+ *   display. Rerun configure after changing this.
+ */
+/* #define WANT_SHM_RENDER */
+
 #endif
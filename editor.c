@@ -26,10 +26,12 @@
 #include "uflags.h"
 #include "config.h"
 #include "utf8.h"
+#include "rowcache.h"
+#include "wrapindex.h"
+#include "shmrender.h"
 
 #include <stdio.h>
 #include <ctype.h>
-#include <math.h>
 
 #include <X11/XKBlib.h>
 #include <X11/keysymdef.h>
@@ -38,9 +40,16 @@
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <err.h>
+#include <stdint.h>
+#include <limits.h>
 
 static char	*get_line_at_cursor(struct cursor *, int);
 static void	 editor_draw(struct editor *, size_t, size_t);
+static void	 editor_draw_strip(struct editor *, int, int);
+#ifdef WANT_LINE_NUMBERS
+static void	 editor_draw_gutter(struct editor *, size_t, size_t);
+#endif
 static int	 editor_scroll_into_view(struct editor *, size_t, size_t);
 static void	 editor_scroll_down(struct editor *, size_t);
 static void	 editor_scroll_up(struct editor *, size_t);
@@ -51,14 +60,55 @@ static int	 editor_mousepress(struct widget *, XButtonEvent *, void *);
 static int	 editor_motion(XMotionEvent *, void *);
 static void	 editor_draw_cursor(struct editor *, struct cursor *);
 static void	 editor_update_geometry(void *);
+static void	 editor_update_prefer(void *);
+static int	 editor_is_shown(struct editor *);
 static void	 editor_find_cursor_pos(struct editor *, int, int,
 		    int *, int *);
 static void	 editor_page_up(struct editor *);
 static void	 editor_page_down(struct editor *);
 static int	 editor_row_is_visible(struct editor *, int);
-static void	 editor_hscroll(struct editor *, int);
+static size_t	 editor_hscroll_step(struct editor *);
+static void	 editor_hscroll(struct editor *, size_t);
+static int	 editor_gutter_width(struct editor *);
+#ifdef WANT_LINE_NUMBERS
+static int	 editor_update_gutter(struct editor *);
+static void	 editor_gutter_free(struct editor *);
+#else
+#define editor_update_gutter(_x) 0
+#endif
 static void	 draw_update(int, int, int, int, BufferUpdate, void *udata);
+static int	 editor_char_width(const char *, size_t, size_t *, int);
+static struct hindex
+		*editor_hindex(struct editor *, int, const char *, size_t);
+static void	 editor_hindex_drop(struct editor *, int);
+static struct checkpoint
+		*editor_hindex_seek_x(struct hindex *, const char *, size_t,
+		    int);
+static struct checkpoint
+		*editor_hindex_seek_offset(struct hindex *, const char *,
+		    size_t, size_t);
+static void	 editor_set_wrap(struct editor *, int);
+static void	 editor_wrap_sync(struct editor *);
+static size_t	 editor_wrap_breaks(struct editor *, int);
+static int	 editor_wrap_lines(struct editor *, int);
+static size_t	 editor_wrap_line(struct editor *, int);
+static int	 editor_wrap_find(struct editor *, size_t, int *);
+static int	 editor_wrap_sub(struct editor *, int, size_t);
+static void	 editor_wrap_layout(struct editor *);
+static int	 editor_wrap_pos(struct editor *, int, int, int);
+static void	 editor_wrap_scroll_to(struct editor *, int, int);
+static int	 editor_wrap_scroll_into_view(struct editor *, int, size_t);
+static void	 editor_wrap_page(struct editor *, int);
+static void	 editor_wrap_center(struct editor *);
+static void	 editor_wrap_damage(struct editor *, int, int);
+static void	 editor_wrap_invalidate(struct editor *, int, int);
+static size_t	 editor_lines(struct editor *);
+static int	 editor_screen_lines(struct editor *);
+static int	 editor_row_y(struct editor *, int);
+static int	 editor_row_at_y(struct editor *, int);
 static void	 editor_draw_cursor_now(struct editor *, int);
+static void	 editor_frame(void *);
+static int	 editor_tail_visible(struct editor *, int);
 
 static int
 editor_offset_from_pos(struct editor *editor, int row, int byteoffset,
@@ -97,23 +147,29 @@ static void
 editor_update_geometry(void *udata)
 {
 	struct editor *editor = udata;
-	int rows;
 
-	font_set(FONT_NORMAL);
-	rows = WIDGET_HEIGHT(editor) / font_height();
-	if (rows <= 0)
-		rows = 1;
+	if (editor->wrapindex != NULL)
+		editor_wrap_layout(editor);
+	else
+		editor->bottom_row = editor->top_row +
+		    editor_screen_lines(editor) - 1;
 
-	editor->bottom_row = editor->top_row + rows - 1;
+	if (editor->dirty_hidden && widget_is_viewable(WIDGET(editor))) {
+		editor->dirty_hidden = 0;
+		widget_damage(WIDGET(editor), 0, WIDGET_HEIGHT(editor));
+	}
 }
 
 static int
 editor_scroll_into_view(struct editor *editor, size_t row, size_t col)
 {
 	size_t d;
-	size_t width_at_offset, offset;
+	size_t width_at_offset, offset, begin, step;
 	int ret, diff, rbound;
 
+	if (editor->wrapindex != NULL)
+		return editor_wrap_scroll_into_view(editor, row, col);
+
 	ret = 0;
 	if (row > editor->bottom_row) {
 		d = row - editor->bottom_row;
@@ -129,25 +185,30 @@ editor_scroll_into_view(struct editor *editor, size_t row, size_t col)
 		ret = 1;
 	}
 
-	for (;;) {
-		offset = editor_offset_from_pos(editor, row,
-		    editor->cursor->offset, &width_at_offset);
+	if (editor_update_gutter(editor))
+		editor_draw(editor, editor->top_row, editor->bottom_row);
 
-		diff = (int) offset - (int) editor->begin_offset;
-		rbound = WIDGET_WIDTH(editor);
+	offset = editor_offset_from_pos(editor, row, editor->cursor->offset,
+	    &width_at_offset);
+	rbound = WIDGET_WIDTH(editor) - editor_gutter_width(editor);
+	assert(rbound > 0);
 
-#ifdef WANT_LINE_NUMBERS
-		assert(rbound > 100);
-		rbound -= 100;
-#endif
+	step = editor_hscroll_step(editor);
+	begin = editor->begin_offset;
+	for (;;) {
+		diff = (int) offset - (int) begin;
 
 		if ((int) (diff + (int) width_at_offset) > rbound)
-			editor_hscroll(editor, 1);
-		else if (diff < 0 && editor->begin_offset > 0)
-			editor_hscroll(editor, -1);
+			begin += step;
+		else if (diff < 0 && begin > step)
+			begin -= step;
+		else if (diff < 0 && begin > 0)
+			begin = 0;
 		else
 			break;
 	}
+	if (begin != editor->begin_offset)
+		editor_hscroll(editor, begin);
 
 	return ret;
 }
@@ -155,7 +216,7 @@ editor_scroll_into_view(struct editor *editor, size_t row, size_t col)
 void
 editor_shrink(struct editor *editor)
 {
-	editor->largest_height = buffer_rows(editor->buffer) * font_height();
+	editor->largest_height = editor_lines(editor) * font_height();
 	editor->old_height = editor_max_height(editor);
 	WIDGET_PREFER_HEIGHT(editor) = editor_max_height(editor);
 	widget_update_geometry(WIDGET(editor));
@@ -169,7 +230,7 @@ editor_max_height(struct editor *editor)
 	font_set(FONT_NORMAL);
 
 	height = MAX(
-	    buffer_rows(editor->buffer) * font_height(),
+	    editor_lines(editor) * font_height(),
 	    editor->largest_height);
 	if (height > editor->largest_height)
 		editor->largest_height = height;
@@ -238,6 +299,17 @@ select_display_str(const char *p, size_t *len, int error)
 	return q;
 }
 
+/*
+ * Long rows are indexed with checkpoints every HINDEX_INTERVAL
+ * characters so that we do not need to measure the row from the
+ * beginning when looking at its far end. Checkpoints are added lazily
+ * up to the point that has been looked at.
+ */
+struct checkpoint {
+	size_t	offset;
+	int	x;
+};
+
 /*
  * Returns the pixel x-coordinate of the leftmost edge of a character
  * for the byte offset in the row.
@@ -255,6 +327,8 @@ editor_offset_from_pos(struct editor *editor, int row, int byteoffset,
 	const char *s, *p;
 	size_t sz, offset, begin, len, width;
 	int x, error;
+	struct hindex *h;
+	struct checkpoint *cp;
 
 	font_set(FONT_NORMAL);
 
@@ -268,6 +342,11 @@ editor_offset_from_pos(struct editor *editor, int row, int byteoffset,
 	offset = 0;
 	x = 0;
 	width = 0;
+	if ((h = editor_hindex(editor, row, s, sz)) != NULL) {
+		cp = editor_hindex_seek_offset(h, s, sz, byteoffset);
+		offset = cp->offset;
+		x = cp->x;
+	}
 	do {
 		begin = offset;
 		x += width;
@@ -296,6 +375,8 @@ editor_pos_from_offset(struct editor *editor, int row, int pxoffset)
 	const char *s, *p;
 	size_t sz, offset, begin, len;
 	int x, error;
+	struct hindex *h;
+	struct checkpoint *cp;
 
 	font_set(FONT_NORMAL);
 
@@ -305,6 +386,11 @@ editor_pos_from_offset(struct editor *editor, int row, int pxoffset)
 
 	offset = 0;
 	x = 0;
+	if ((h = editor_hindex(editor, row, s, sz)) != NULL) {
+		cp = editor_hindex_seek_x(h, s, sz, pxoffset);
+		offset = cp->offset;
+		x = cp->x;
+	}
 	do {
 		begin = offset;
 		if (utf8_incr_col(s, sz, &offset, &error) == 0)
@@ -319,25 +405,689 @@ editor_pos_from_offset(struct editor *editor, int row, int pxoffset)
 }
 
 /*
- * Scroll view horizontally.
- * TODO: Optimize with XCopyArea instead of redrawing whole line.
+ * Steps over the character at 'offset' and returns its width when
+ * drawn at 'x', or -1 if there are no more characters.
  */
+static int
+editor_char_width(const char *s, size_t sz, size_t *offset, int x)
+{
+	const char *p;
+	size_t begin, len;
+	int error;
+
+	begin = *offset;
+	if (utf8_incr_col(s, sz, offset, &error) == 0)
+		return -1;
+	assert(begin < *offset);
+	len = *offset - begin;
+	p = select_display_str(&s[begin], &len, error);
+	return font_str_width(x, p, len);
+}
+
 static void
-editor_hscroll(struct editor *editor, int dir)
+editor_hindex_add(struct hindex *h, size_t offset, int x)
 {
-	switch (dir) {
-	case 1:
-		editor->begin_offset += WIDGET_WIDTH(editor) / 2;
-		break;
-	case -1:
-		if (editor->begin_offset > WIDGET_WIDTH(editor) / 2)
-			editor->begin_offset -= WIDGET_WIDTH(editor) / 2;
+	if (h->ncps == h->alloc)
+		if (grow_array((void **) &h->cps, sizeof(*h->cps),
+		    &h->alloc) == -1)
+			err(1, "grow_array");
+
+	h->cps[h->ncps].offset = offset;
+	h->cps[h->ncps].x = x;
+	h->ncps++;
+}
+
+/*
+ * Returns index for the row, or NULL if the row is short enough to be
+ * measured from the beginning. The least recently used index is
+ * recycled.
+ */
+static struct hindex *
+editor_hindex(struct editor *editor, int row, const char *s, size_t len)
+{
+	struct hindex *h, *lru;
+	size_t i;
+
+	if (s == NULL || len < HINDEX_MIN_ROW_BYTES)
+		return NULL;
+
+	lru = &editor->hindex[0];
+	for (i = 0; i < EDITOR_HINDEX; i++) {
+		h = &editor->hindex[i];
+		if (h->ncps > 0 && h->row == row)
+			break;
+		if (h->used < lru->used)
+			lru = h;
+	}
+	if (i == EDITOR_HINDEX)
+		h = lru;
+
+	if (h->ncps == 0 || h->row != row || h->len != len) {
+		h->row = row;
+		h->len = len;
+		h->ncps = 0;
+		h->done = 0;
+		editor_hindex_add(h, 0, 0);
+	}
+	h->used = ++editor->hindex_tick;
+	return h;
+}
+
+/*
+ * Forgets indices from 'row' onwards, as rows may have been changed
+ * or shifted.
+ */
+static void
+editor_hindex_drop(struct editor *editor, int row)
+{
+	size_t i;
+
+	for (i = 0; i < EDITOR_HINDEX; i++)
+		if (editor->hindex[i].row >= row) {
+			editor->hindex[i].ncps = 0;
+			editor->hindex[i].used = 0;
+		}
+}
+
+/*
+ * Measures one more interval of the row. Returns -1 if the whole row
+ * has already been indexed.
+ */
+static int
+editor_hindex_extend(struct hindex *h, const char *s, size_t len)
+{
+	size_t offset;
+	int i, w, x;
+
+	if (h->done)
+		return -1;
+
+	offset = h->cps[h->ncps - 1].offset;
+	x = h->cps[h->ncps - 1].x;
+	for (i = 0; i < HINDEX_INTERVAL; i++) {
+		if ((w = editor_char_width(s, len, &offset, x)) == -1)
+			break;
+		x += w;
+	}
+	if (i < HINDEX_INTERVAL || offset >= len)
+		h->done = 1;
+	if (i == 0)
+		return -1;
+
+	editor_hindex_add(h, offset, x);
+	return 0;
+}
+
+/*
+ * Returns the last checkpoint at or left from pixel position 'px'.
+ */
+static struct checkpoint *
+editor_hindex_seek_x(struct hindex *h, const char *s, size_t len, int px)
+{
+	size_t lo, hi, mid;
+
+	while (h->cps[h->ncps - 1].x <= px &&
+	    editor_hindex_extend(h, s, len) == 0)
+		;
+
+	lo = 0;
+	hi = h->ncps;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (h->cps[mid].x <= px)
+			lo = mid;
 		else
-			editor->begin_offset = 0;
-		break;
+			hi = mid;
+	}
+	return &h->cps[lo];
+}
+
+/*
+ * Returns the last checkpoint at or before byte 'offset'.
+ */
+static struct checkpoint *
+editor_hindex_seek_offset(struct hindex *h, const char *s, size_t len,
+    size_t offset)
+{
+	size_t lo, hi, mid;
+
+	while (h->cps[h->ncps - 1].offset <= offset &&
+	    editor_hindex_extend(h, s, len) == 0)
+		;
+
+	lo = 0;
+	hi = h->ncps;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (h->cps[mid].offset <= offset)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return &h->cps[lo];
+}
+
+/*
+ * In soft-wrap mode rows are split to display lines that fit the
+ * window, and the view begins from display line 'top_sub' of
+ * 'top_row'. The number of display lines of each row is kept in a wrap
+ * index so that display lines map to rows and back in O(log n). Rows
+ * are measured only when they are looked at.
+ */
+static void
+editor_set_wrap(struct editor *editor, int wrap)
+{
+	if (wrap == (editor->wrapindex != NULL))
+		return;
+
+	if (wrap) {
+		if ((editor->wrapindex = wrapindex_create()) == NULL) {
+			warn("wrapindex_create");
+			return;
+		}
+		editor->wrap_width = -1;
+		editor->wrap_from = 0;
+		editor->breaks_row = -1;
+		editor->begin_offset = 0;
+	} else {
+		wrapindex_free(editor->wrapindex);
+		editor->wrapindex = NULL;
+	}
+	editor->top_sub = 0;
+	editor->bottom_sub = 0;
+
+	if (!editor_is_shown(editor))
+		return;
+
+	editor_update_geometry(editor);
+	editor->old_height = editor_max_height(editor);
+	WIDGET_PREFER_HEIGHT(editor) = editor->old_height;
+	widget_update_geometry(WIDGET(editor));
+	widget_damage(WIDGET(editor), 0, WIDGET_HEIGHT(editor));
+}
+
+/*
+ * Brings the wrap index up to date with the buffer rows and the wrap
+ * width. Rows from 'wrap_from' onwards may have shifted if the number
+ * of rows changed.
+ */
+static void
+editor_wrap_sync(struct editor *editor)
+{
+	struct wrapindex *wi = editor->wrapindex;
+	size_t rows;
+	int width;
+
+	width = WIDGET_WIDTH(editor) - editor_gutter_width(editor);
+	if (width != editor->wrap_width) {
+		editor->wrap_width = width;
+		wrapindex_invalidate(wi);
+	}
+
+	rows = buffer_rows(editor->buffer);
+	if (rows != wrapindex_rows(wi))
+		wrapindex_truncate(wi, editor->wrap_from);
+	editor->wrap_from = INT_MAX;
+	wrapindex_truncate(wi, rows);
+	while (wrapindex_rows(wi) < rows)
+		wrapindex_append(wi, 1);
+}
+
+static void
+editor_wrap_add_break(struct editor *editor, size_t offset)
+{
+	if (editor->nbreaks == editor->breaks_alloc)
+		if (grow_array((void **) &editor->breaks,
+		    sizeof(*editor->breaks), &editor->breaks_alloc) == -1)
+			err(1, "grow_array");
+
+	editor->breaks[editor->nbreaks++] = offset;
+}
+
+/*
+ * Splits row to display lines and stores the byte offsets where they
+ * begin. Returns the number of display lines.
+ */
+static size_t
+editor_wrap_breaks(struct editor *editor, int row)
+{
+	const char *s;
+	size_t len, offset, begin;
+	int x, w;
+
+	if (editor->breaks_row == row &&
+	    wrapindex_is_valid(editor->wrapindex, row))
+		return editor->nbreaks;
+
+	font_set(FONT_NORMAL);
+
+	editor->nbreaks = 0;
+	editor_wrap_add_break(editor, 0);
+	if ((s = buffer_u8str_at(editor->buffer, row, &len)) != NULL) {
+		x = 0;
+		offset = 0;
+		for (;;) {
+			begin = offset;
+			if ((w = editor_char_width(s, len, &offset, x)) == -1)
+				break;
+			if (x > 0 && x + w > editor->wrap_width) {
+				editor_wrap_add_break(editor, begin);
+				offset = begin;
+				x = 0;
+				continue;
+			}
+			x += w;
+		}
+	}
+
+	editor->breaks_row = row;
+	wrapindex_set(editor->wrapindex, row, editor->nbreaks);
+	return editor->nbreaks;
+}
+
+/*
+ * Returns the number of display lines of the row. Rows past the end of
+ * buffer take one display line each.
+ */
+static int
+editor_wrap_lines(struct editor *editor, int row)
+{
+	if ((size_t) row >= wrapindex_rows(editor->wrapindex))
+		return 1;
+	if (wrapindex_is_valid(editor->wrapindex, row))
+		return wrapindex_get(editor->wrapindex, row);
+	return editor_wrap_breaks(editor, row);
+}
+
+/*
+ * Returns the display line number where the row begins.
+ */
+static size_t
+editor_wrap_line(struct editor *editor, int row)
+{
+	size_t n;
+
+	n = wrapindex_rows(editor->wrapindex);
+	if ((size_t) row <= n)
+		return wrapindex_prefix(editor->wrapindex, row);
+	return wrapindex_prefix(editor->wrapindex, n) + row - n;
+}
+
+/*
+ * Returns the row for display line 'line', and which display line of
+ * the row it is in 'sub'.
+ */
+static int
+editor_wrap_find(struct editor *editor, size_t line, int *sub)
+{
+	size_t row, rem;
+
+	row = wrapindex_find(editor->wrapindex, line, &rem);
+	if (row >= wrapindex_rows(editor->wrapindex)) {
+		row += rem;
+		rem = 0;
+	}
+	if (sub != NULL)
+		*sub = rem;
+	return row;
+}
+
+/*
+ * Returns the display line of the row that contains byte 'offset'.
+ */
+static int
+editor_wrap_sub(struct editor *editor, int row, size_t offset)
+{
+	size_t lo, hi, mid;
+
+	if ((size_t) row >= wrapindex_rows(editor->wrapindex))
+		return 0;
+
+	lo = 0;
+	hi = editor_wrap_breaks(editor, row);
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (editor->breaks[mid] <= offset)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Measures visible rows and finds out the last visible display line.
+ */
+static void
+editor_wrap_layout(struct editor *editor)
+{
+	int row, lines, seen, n;
+
+	editor_wrap_sync(editor);
+
+	lines = editor_screen_lines(editor);
+	n = editor_wrap_lines(editor, editor->top_row);
+	if (editor->top_sub >= n)
+		editor->top_sub = n - 1;
+
+	row = editor->top_row;
+	seen = -editor->top_sub;
+	while (seen + (n = editor_wrap_lines(editor, row)) < lines) {
+		seen += n;
+		row++;
+	}
+	editor->bottom_row = row;
+	editor->bottom_sub = lines - seen - 1;
+}
+
+/*
+ * Returns byte offset of the character at pixel position 'px' on
+ * display line 'sub' of the row.
+ */
+static int
+editor_wrap_pos(struct editor *editor, int row, int sub, int px)
+{
+	const char *s;
+	size_t len, n, offset, begin, end;
+	int x;
+
+	if ((size_t) row >= wrapindex_rows(editor->wrapindex) ||
+	    (s = buffer_u8str_at(editor->buffer, row, &len)) == NULL)
+		return 0;
+
+	n = editor_wrap_breaks(editor, row);
+	offset = editor->breaks[MIN((size_t) sub, n - 1)];
+	end = (size_t) sub + 1 < n ? editor->breaks[sub + 1] : len;
+
+	x = 0;
+	begin = offset;
+	while (offset < end) {
+		begin = offset;
+		x += editor_char_width(s, len, &offset, x);
+		if (x > px)
+			return begin;
+	}
+
+	/*
+	 * Past the end of a display line that continues on the next
+	 * line, stay on the last character.
+	 */
+	return (size_t) sub + 1 < n ? begin : end;
+}
+
+/*
+ * Moves the view to begin from display line 'sub' of 'row'. Contents
+ * that stay visible are moved instead of drawn again.
+ */
+static void
+editor_wrap_scroll_to(struct editor *editor, int row, int sub)
+{
+	size_t old_line, new_line;
+	int old_row, old_sub;
+
+	old_row = editor->top_row;
+	old_sub = editor->top_sub;
+	editor->top_row = row;
+	editor->top_sub = sub;
+	editor_wrap_layout(editor);
+
+	old_line = editor_wrap_line(editor, old_row) + old_sub;
+	new_line = editor_wrap_line(editor, editor->top_row) +
+	    editor->top_sub;
+	if (new_line > old_line)
+		editor_scroll_down(editor, new_line - old_line);
+	else if (new_line < old_line)
+		editor_scroll_up(editor, old_line - new_line);
+}
+
+static int
+editor_wrap_scroll_into_view(struct editor *editor, int row, size_t offset)
+{
+	int sub, n;
+
+	editor_wrap_layout(editor);
+
+	sub = editor_wrap_sub(editor, row, offset);
+	if (row < editor->top_row ||
+	    (row == editor->top_row && sub < editor->top_sub)) {
+		editor_wrap_scroll_to(editor, row, sub);
+		return 1;
+	}
+	if (row < editor->bottom_row ||
+	    (row == editor->bottom_row && sub <= editor->bottom_sub))
+		return 0;
+
+	/*
+	 * Walk up from the display line that should be the last one.
+	 */
+	n = editor_screen_lines(editor) - 1;
+	while (n > sub && row > 0) {
+		n -= sub + 1;
+		row--;
+		sub = editor_wrap_lines(editor, row) - 1;
+	}
+	editor_wrap_scroll_to(editor, row, n > sub ? 0 : sub - n);
+	return 1;
+}
+
+/*
+ * Scrolls by a page of display lines and moves the cursor to the
+ * beginning of the view.
+ */
+static void
+editor_wrap_page(struct editor *editor, int dir)
+{
+	size_t top, total, lines, offset;
+	int row, sub;
+
+	editor_wrap_layout(editor);
+
+	lines = editor_screen_lines(editor);
+	top = editor_wrap_line(editor, editor->top_row) + editor->top_sub;
+	total = editor_wrap_line(editor, buffer_rows(editor->buffer));
+	if (dir < 0)
+		top = top > lines ? top - lines : 0;
+	else if (top + lines < total)
+		top += lines;
+
+	row = editor_wrap_find(editor, top, &sub);
+	editor_wrap_scroll_to(editor, row, sub);
+
+	offset = 0;
+	if ((size_t) editor->top_row < buffer_rows(editor->buffer))
+		offset = editor->breaks[MIN((size_t) editor->top_sub,
+		    editor_wrap_breaks(editor, editor->top_row) - 1)];
+	buffer_set_cursor(editor->buffer, editor->cursor, editor->top_row,
+	    offset);
+}
+
+/*
+ * Scrolls so that the cursor is in the middle.
+ */
+static void
+editor_wrap_center(struct editor *editor)
+{
+	size_t line, half;
+	int row, sub;
+
+	editor_wrap_layout(editor);
+
+	line = editor_wrap_line(editor, editor->cursor->row) +
+	    editor_wrap_sub(editor, editor->cursor->row,
+	    editor->cursor->offset);
+	half = editor_screen_lines(editor) / 2;
+	line = line > half ? line - half : 0;
+
+	row = editor_wrap_find(editor, line, &sub);
+	editor_wrap_scroll_to(editor, row, sub);
+}
+
+/*
+ * Damages rows from 'row' to 'to_row', or everything below them if
+ * the number of their display lines changed.
+ */
+static void
+editor_wrap_damage(struct editor *editor, int row, int to_row)
+{
+	size_t old_lines, new_lines;
+	int to_px;
+
+	editor_wrap_sync(editor);
+	old_lines = editor_wrap_line(editor, to_row + 1) -
+	    editor_wrap_line(editor, row);
+	editor_wrap_layout(editor);
+	new_lines = editor_wrap_line(editor, to_row + 1) -
+	    editor_wrap_line(editor, row);
+
+	if (old_lines == new_lines)
+		to_px = editor_row_y(editor, to_row + 1);
+	else
+		to_px = WIDGET_HEIGHT(editor);
+	widget_damage(WIDGET(editor), editor_row_y(editor, row), to_px);
+}
+
+/*
+ * Forgets display lines of changed rows.
+ */
+static void
+editor_wrap_invalidate(struct editor *editor, int row, int to_row)
+{
+	size_t i;
+
+	for (i = row; i <= (size_t) to_row &&
+	    i < wrapindex_rows(editor->wrapindex); i++)
+		wrapindex_invalidate_row(editor->wrapindex, i);
+	editor->wrap_from = MIN(editor->wrap_from, row);
+}
+
+/*
+ * Returns the number of display lines needed for the whole buffer.
+ */
+static size_t
+editor_lines(struct editor *editor)
+{
+	if (editor->wrapindex == NULL)
+		return buffer_rows(editor->buffer);
+
+	editor_wrap_sync(editor);
+	return editor_wrap_line(editor, buffer_rows(editor->buffer));
+}
+
+static int
+editor_screen_lines(struct editor *editor)
+{
+	int lines;
+
+	font_set(FONT_NORMAL);
+	if ((lines = WIDGET_HEIGHT(editor) / font_height()) <= 0)
+		lines = 1;
+	return lines;
+}
+
+/*
+ * Returns y-coordinate where the row begins, which is negative if the
+ * row begins above the view.
+ */
+static int
+editor_row_y(struct editor *editor, int row)
+{
+	long line;
+
+	if (editor->wrapindex == NULL)
+		return (row - editor->top_row) * font_height();
+
+	line = (long) editor_wrap_line(editor, row) -
+	    (long) editor_wrap_line(editor, editor->top_row) - editor->top_sub;
+	return line * font_height();
+}
+
+/*
+ * Returns the row visible at y-coordinate 'y'.
+ */
+static int
+editor_row_at_y(struct editor *editor, int y)
+{
+	if (editor->wrapindex == NULL)
+		return editor->top_row + y / font_height();
+
+	return editor_wrap_find(editor, editor_wrap_line(editor,
+	    editor->top_row) + editor->top_sub + y / font_height(), NULL);
+}
+
+static size_t
+editor_hscroll_step(struct editor *editor)
+{
+#ifdef HSCROLL_STEP
+	return HSCROLL_STEP;
+#else
+	return MAX(WIDGET_WIDTH(editor) / 2, 1);
+#endif
+}
+
+/*
+ * Scroll view horizontally to 'begin_offset'. Contents that stay visible
+ * are moved with XCopyArea and only the newly exposed strip is drawn.
+ */
+static void
+editor_hscroll(struct editor *editor, size_t begin_offset)
+{
+	int gutter, width, delta;
+
+	gutter = editor_gutter_width(editor);
+	width = WIDGET_WIDTH(editor) - gutter;
+	delta = (int) begin_offset - (int) editor->begin_offset;
+	editor->begin_offset = begin_offset;
+
+	if (delta == 0)
+		return;
+
+	if (abs(delta) >= width) {
+		editor_draw(editor, editor->top_row, editor->bottom_row);
+		return;
+	}
+
+	if (delta > 0) {
+		XCopyArea(DPY(editor->dpy), editor->window, editor->window,
+		    editor->gc, gutter + delta, 0, width - delta,
+		    WIDGET_HEIGHT(editor), gutter, 0);
+		editor_draw_strip(editor, WIDGET_WIDTH(editor) - delta,
+		    WIDGET_WIDTH(editor));
+	} else {
+		XCopyArea(DPY(editor->dpy), editor->window, editor->window,
+		    editor->gc, gutter, 0, width + delta,
+		    WIDGET_HEIGHT(editor), gutter - delta, 0);
+		editor_draw_strip(editor, gutter, gutter - delta);
 	}
-	draw_update(editor->top_row, 0, editor->bottom_row, 0,
-	    BUFFER_UPDATE_LINE, editor);
+}
+
+/*
+ * Returns 1 if the editor and all of its parents are shown.
+ */
+static int
+editor_is_shown(struct editor *editor)
+{
+	struct widget *widget;
+
+	for (widget = WIDGET(editor); widget != NULL; widget = widget->parent)
+		if (!widget->visible)
+			return 0;
+
+	return 1;
+}
+
+/*
+ * Called when we are about to be shown.
+ */
+static void
+editor_update_prefer(void *udata)
+{
+	struct editor *editor = udata;
+
+	if (!editor->dirty_hidden || editor->buffer == NULL)
+		return;
+
+	editor->old_height = editor_max_height(editor);
+	WIDGET_PREFER_HEIGHT(editor) = editor->old_height;
 }
 
 static void
@@ -352,35 +1102,118 @@ draw_update(
 	struct editor *ctx = udata;
 	int row_px, to_row_px;
 
-	row_px = (row - ctx->top_row) * font_height();
-	to_row_px = (to_row - ctx->top_row + 1) * font_height();
+	editor_hindex_drop(ctx, row);
+	if (ctx->wrapindex != NULL)
+		editor_wrap_invalidate(ctx, row, to_row);
 
-	if (WIDGET(ctx)->need_expose == 0) {
-		WIDGET(ctx)->expose_from_px = row_px;
-		WIDGET(ctx)->expose_to_px = to_row_px;
-		WIDGET(ctx)->need_expose = 1;
-	} else {
-		WIDGET(ctx)->expose_from_px = MIN(row_px,
-		    WIDGET(ctx)->expose_from_px);
-		WIDGET(ctx)->expose_to_px = MAX(to_row_px,
-		    WIDGET(ctx)->expose_to_px);
+	/*
+	 * While hidden, just remember that we need to catch up when we
+	 * are shown again. See editor_update_prefer().
+	 */
+	if (!editor_is_shown(ctx)) {
+		ctx->dirty_hidden = 1;
+		return;
 	}
 
+	/*
+	 * Occluded editors are not drawn, but preferred height is still
+	 * kept up to date because the layout decides from it whether we
+	 * get some space.
+	 */
+	if (widget_is_viewable(WIDGET(ctx)) && ctx->wrapindex != NULL)
+		editor_wrap_damage(ctx, row, to_row);
+	else if (widget_is_viewable(WIDGET(ctx))) {
+		row_px = (row - ctx->top_row) * font_height();
+		to_row_px = (to_row - ctx->top_row + 1) * font_height();
+		widget_damage(WIDGET(ctx), row_px, to_row_px);
+	} else
+		ctx->dirty_hidden = 1;
+
 	if (ctx->old_height != editor_max_height(ctx)) {
 		ctx->old_height = editor_max_height(ctx);
 		WIDGET_PREFER_HEIGHT(ctx) = editor_max_height(ctx);
 		widget_update_geometry(WIDGET(ctx));
 	}
 
-	/* TODO: Bring back autoscroll by re-enabling this. */
-#if 0
 	/*
-	 * If we didn't scroll, we need to draw from here and we draw
-	 * just the modified line, nothing else.
+	 * Following the output is done in editor_frame().
 	 */
-	if (editor_scroll_into_view(ctx, to_row, to_col) == 0)
-		editor_draw(ctx, row, to_row);
-#endif
+}
+
+/*
+ * When following, new rows at the end of buffer are scrolled into
+ * view once per frame, so that a flood of output moves the contents
+ * with a single XCopyArea instead of one row at a time. Scrolling up
+ * pins the view until the end is visible again or End is pressed.
+ */
+void
+editor_set_follow(struct editor *editor, int follow)
+{
+	editor->follow = follow;
+	editor->pinned = 0;
+}
+
+static int
+editor_tail_visible(struct editor *editor, int last)
+{
+	if (last < editor->bottom_row)
+		return 1;
+	if (last > editor->bottom_row)
+		return 0;
+	return editor->wrapindex == NULL ||
+	    editor->bottom_sub + 1 >= editor_wrap_lines(editor, last);
+}
+
+/*
+ * Returns how many rows there are below a pinned view, or 0 if the
+ * view follows the end.
+ */
+int
+editor_rows_behind(struct editor *editor)
+{
+	size_t rows;
+
+	if (!editor->pinned || (rows = buffer_rows(editor->buffer)) == 0)
+		return 0;
+	if (editor_tail_visible(editor, rows - 1))
+		return 0;
+	return rows - 1 - editor->bottom_row;
+}
+
+static void
+editor_frame(void *udata)
+{
+	struct editor *editor = udata;
+	size_t rows;
+	int last, d;
+
+	if (!editor->follow || !editor_is_shown(editor) ||
+	    !widget_is_viewable(WIDGET(editor)))
+		return;
+
+	if ((rows = buffer_rows(editor->buffer)) == 0)
+		return;
+	last = rows - 1;
+
+	if (editor->wrapindex != NULL)
+		editor_wrap_layout(editor);
+	if (editor_tail_visible(editor, last)) {
+		editor->pinned = 0;
+		return;
+	}
+	if (editor->pinned)
+		return;
+
+	if (editor->wrapindex != NULL) {
+		editor_wrap_scroll_into_view(editor, last,
+		    buffer_bytes_at(editor->buffer, last));
+		return;
+	}
+
+	d = last - editor->bottom_row;
+	editor->top_row += d;
+	editor->bottom_row += d;
+	editor_scroll_down(editor, d);
 }
 
 void
@@ -406,6 +1239,31 @@ editor_set_resize_handler(struct editor *editor, EditResizeHandler resize,
 	editor->resize_udata = udata;
 }
 
+/*
+ * Sets the string whose matches are highlighted.
+ */
+static void
+editor_set_search(struct editor *editor, const char *s, size_t len)
+{
+	if (editor->search_len == len && (len == 0 ||
+	    memcmp(editor->search, s, len) == 0))
+		return;
+
+	free(editor->search);
+	editor->search = NULL;
+	editor->search_len = 0;
+	if (len > 0) {
+		if ((editor->search = malloc(len)) == NULL) {
+			warn("malloc");
+			return;
+		}
+		memcpy(editor->search, s, len);
+		editor->search_len = len;
+	}
+
+	widget_damage(WIDGET(editor), 0, WIDGET_HEIGHT(editor));
+}
+
 static int
 editor_search(struct editor *editor, const char *s, size_t len,
     int dir, int want_case)
@@ -414,6 +1272,8 @@ editor_search(struct editor *editor, const char *s, size_t len,
 	int i;
 	const char *p;
 
+	editor_set_search(editor, s, len);
+
 	rows = buffer_rows(editor->buffer);
 	if (rows == 0)
 		return 0;
@@ -499,6 +1359,7 @@ editor_create(struct dpy *dpy, struct cursor *cursor, EditSubmitHandler submit,
 	const char *name, struct widget *parent)
 {
 	struct editor *editor;
+	XGCValues gcv;
 
 	if ((editor = calloc(1, sizeof(struct editor))) == NULL)
 		return NULL;
@@ -517,11 +1378,17 @@ editor_create(struct dpy *dpy, struct cursor *cursor, EditSubmitHandler submit,
 	widget_set_motion_callback(WIDGET(editor), editor_motion, editor);
 
 	editor->gc = XCreateGC(DPY(dpy), WINDOW(editor), 0, NULL);
+	gcv.graphics_exposures = False;
+	editor->blit_gc = XCreateGC(DPY(dpy), WINDOW(editor),
+	    GCGraphicsExposures, &gcv);
 
 	editor->window = WINDOW(editor);
 
 	widget_set_geometry_callback(WIDGET(editor), editor_update_geometry,
 	    editor);
+	widget_set_update_prefer_callback(WIDGET(editor), editor_update_prefer,
+	    editor);
+	widget_set_frame_callback(WIDGET(editor), editor_frame, editor);
 
 	font_set(FONT_NORMAL);
 	WIDGET_PREFER_HEIGHT(editor) = font_height();
@@ -534,6 +1401,10 @@ editor_create(struct dpy *dpy, struct cursor *cursor, EditSubmitHandler submit,
 	editor->bgcolor = bgcolor;
 	editor->max_rows = max_rows;
 	editor->prefer_offset = -1;
+#ifdef WANT_SOFT_WRAP
+	if (max_rows != 1)
+		editor_set_wrap(editor, 1);
+#endif
 
 	buffer_add_listener(cursor->buffer, draw_update, editor);
 
@@ -570,10 +1441,24 @@ void
 editor_free(struct editor *editor)
 {
 	extern struct dpy *dpy;
+	size_t i;
 
 	buffer_remove_listener(editor->buffer, draw_update);
 	if (editor->gc)
 		XFreeGC(DPY(dpy), editor->gc);
+	if (editor->blit_gc)
+		XFreeGC(DPY(dpy), editor->blit_gc);
+#ifdef WANT_LINE_NUMBERS
+	editor_gutter_free(editor);
+	free(editor->gutter_slots);
+#endif
+	for (i = 0; i < EDITOR_HINDEX; i++)
+		free(editor->hindex[i].cps);
+	if (editor->wrapindex != NULL)
+		wrapindex_free(editor->wrapindex);
+	free(editor->breaks);
+	free(editor->runs);
+	free(editor->search);
 	widget_free(WIDGET(editor));
 	free(editor);
 }
@@ -598,6 +1483,16 @@ static void
 editor_find_cursor_pos(struct editor *editor, int ex, int ey, int *row,
     int *offset)
 {
+	int sub;
+
+	if (editor->wrapindex != NULL) {
+		*row = editor_wrap_find(editor, editor_wrap_line(editor,
+		    editor->top_row) + editor->top_sub + ey / font_height(),
+		    &sub);
+		*offset = editor_wrap_pos(editor, *row, sub, ex);
+		return;
+	}
+
 	*row = ey / font_height();
 	*row += editor->top_row;
 	*offset = editor_pos_from_offset(editor, *row, ex);
@@ -617,6 +1512,12 @@ editor_page_up(struct editor *vc)
 {
 	int rows, page;
 
+	vc->pinned = 1;
+	if (vc->wrapindex != NULL) {
+		editor_wrap_page(vc, -1);
+		return;
+	}
+
 	rows = WIDGET_HEIGHT(vc) / font_height();
 	page = vc->cursor->row / rows;
 
@@ -641,6 +1542,11 @@ editor_page_down(struct editor *vc)
 {
 	int rows, page, bottom;
 
+	if (vc->wrapindex != NULL) {
+		editor_wrap_page(vc, 1);
+		return;
+	}
+
 	rows = WIDGET_HEIGHT(vc) / font_height();
 	page = vc->cursor->row / rows;
 
@@ -672,9 +1578,7 @@ editor_motion(XMotionEvent *e, void *udata)
 	old_offset = editor->cursor->offset;
 
 	editor_draw_cursor(editor, editor->cursor);
-#ifdef WANT_LINE_NUMBERS
-	e->x -= 100;
-#endif
+	e->x -= editor_gutter_width(editor);
 	e->x += editor->begin_offset;
 	editor_find_cursor_pos(editor, e->x, e->y, &row, &offset);
 
@@ -705,9 +1609,7 @@ editor_mousepress(struct widget *widget, XButtonEvent *e, void *udata)
 
 	switch (e->button) {
 	case 1:
-#ifdef WANT_LINE_NUMBERS
-		e->x -= 100;
-#endif
+		e->x -= editor_gutter_width(editor);
 		e->x += editor->begin_offset;
 		buffer_clear_mark(editor->buffer, editor->cursor->row);
 		editor_find_cursor_pos(editor, e->x, e->y, &row, &col);
@@ -717,9 +1619,7 @@ editor_mousepress(struct widget *widget, XButtonEvent *e, void *udata)
 	case 2:
 		buffer_copy_region(editor->buffer, editor->cursor);
 
-#ifdef WANT_LINE_NUMBERS
-		e->x -= 100;
-#endif
+		e->x -= editor_gutter_width(editor);
 		e->x += editor->begin_offset;
 		buffer_clear_mark(editor->buffer, editor->cursor->row);
 		editor_find_cursor_pos(editor, e->x, e->y, &row, &col);
@@ -728,9 +1628,7 @@ editor_mousepress(struct widget *widget, XButtonEvent *e, void *udata)
 		buffer_yank(editor->buffer, editor->cursor);
 		return 1;
 	case 3:
-#ifdef WANT_LINE_NUMBERS
-		e->x -= 100;
-#endif
+		e->x -= editor_gutter_width(editor);
 		e->x += editor->begin_offset;
 		editor_find_cursor_pos(editor, e->x, e->y, &row, &col);
 		offset = (size_t) col;
@@ -787,6 +1685,8 @@ editor_keypress(XKeyEvent *e, void *udata)
 				widget_hide(WIDGET(vc));
 				widget_focus(WIDGET(vc->prompt_parent));
 			}
+			editor_set_search(vc->prompt_parent != NULL ?
+			    vc->prompt_parent : vc, NULL, 0);
 			buffer_clear_mark(vc->buffer, vc->cursor->row);
 			return 1;
 		}
@@ -801,6 +1701,11 @@ editor_keypress(XKeyEvent *e, void *udata)
 			}
 			buffer_clear_mark(vc->buffer, vc->cursor->row);
 			return 1;
+		case XK_w:
+			editor_set_wrap(vc, vc->wrapindex == NULL);
+			editor_scroll_into_view(vc, vc->cursor->row,
+			    vc->cursor->offset);
+			return 1;
 		}
 	} else if (sym == XK_x && e->state & ControlMask) {
 		vc->x_on = 1;
@@ -831,6 +1736,8 @@ editor_keypress(XKeyEvent *e, void *udata)
 				widget_hide(WIDGET(vc));
 				widget_focus(WIDGET(vc->prompt_parent));
 			}
+			editor_set_search(vc->prompt_parent != NULL ?
+			    vc->prompt_parent : vc, NULL, 0);
 			buffer_clear_mark(vc->buffer, vc->cursor->row);
 			return 1;
 		case XK_s:
@@ -906,6 +1813,10 @@ editor_keypress(XKeyEvent *e, void *udata)
 			editor_draw_cursor(vc, vc->cursor);
 			return 1;
 		case XK_l:
+			if (vc->wrapindex != NULL) {
+				editor_wrap_center(vc);
+				return 1;
+			}
 			diff = vc->cursor->row -
 			    ((vc->top_row + vc->bottom_row) / 2);
 			if (vc->top_row + diff <= 0)
@@ -1007,6 +1918,16 @@ editor_keypress(XKeyEvent *e, void *udata)
 		editor_scroll_into_view(vc, vc->cursor->row,
 		    vc->cursor->offset);
 		return 1;
+	case XK_End:
+		vc->pinned = 0;
+		if ((row = buffer_rows(vc->buffer) - 1) >= 0)
+			buffer_set_cursor(vc->buffer, vc->cursor, row,
+			    buffer_bytes_at(vc->buffer, row));
+		editor_scroll_into_view(vc, vc->cursor->row,
+		    vc->cursor->offset);
+		if (vc->tail != NULL)
+			vc->tail(vc->tail_udata);
+		return 1;
 	case XK_BackSpace:
 		buffer_erase(vc->buffer, vc->cursor);
 		editor_scroll_into_view(vc, vc->cursor->row,
@@ -1065,12 +1986,14 @@ editor_scroll_down(struct editor *editor, size_t steps)
 	/*
 	 * Move previous contents up, draw bottom
 	 */
+	widget_scroll_damage(WIDGET(editor), -(int) steps * font_height());
 	if (steps * font_height() < WIDGET_HEIGHT(editor)) {
 		XCopyArea(DPY(editor->dpy), editor->window, editor->window,
 		    editor->gc, 0, steps * font_height(),
 		    WIDGET_WIDTH(editor), WIDGET_HEIGHT(editor) -
 		    (steps * font_height()), 0, 0);
-		editor_draw(editor, editor->bottom_row - (steps-1),
+		editor_draw(editor, editor_row_at_y(editor,
+		    WIDGET_HEIGHT(editor) - steps * font_height()),
 		    editor->bottom_row);
 	} else {
 		editor_draw(editor, editor->top_row, editor->bottom_row);
@@ -1083,47 +2006,275 @@ editor_scroll_up(struct editor *editor, size_t steps)
 	/*
 	 * Move previous contents down, draw up
 	 */
+	editor->pinned = 1;
+	widget_scroll_damage(WIDGET(editor), (int) steps * font_height());
 	if (steps * font_height() < WIDGET_HEIGHT(editor)) {
 		XCopyArea(DPY(editor->dpy), editor->window, editor->window,
 		    editor->gc, 0, 0,
 		    WIDGET_WIDTH(editor), WIDGET_HEIGHT(editor) -
 		    (steps * font_height()), 0, steps * font_height());
 		editor_draw(editor, editor->top_row,
-		    editor->top_row + (steps-1));
+		    editor_row_at_y(editor, steps * font_height() - 1));
 	} else {
 		editor_draw(editor, editor->top_row, editor->bottom_row);
 	}
 }
 
+/*
+ * Returns the first style run that ends after 'offset'.
+ */
+static struct rowrun *
+editor_find_run(struct editor *editor, size_t offset)
+{
+	size_t lo, hi, mid;
+
+	lo = 0;
+	hi = editor->nruns;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (editor->runs[mid].end <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return &editor->runs[lo];
+}
+
+static int
+editor_run_color(struct editor *editor, size_t offset)
+{
+	struct rowrun *run;
+
+	run = editor_find_run(editor, offset);
+	if (run < &editor->runs[editor->nruns] && run->start <= offset)
+		return run->bgcolor;
+
+	return editor->bgcolor;
+}
+
 static void
-editor_draw_eol_cursor(struct editor *editor, size_t *x, int *sx,
-    size_t row, size_t y, size_t orig_len)
+editor_add_run(struct editor *editor, size_t start, size_t end, int bgcolor,
+    int ctrl)
 {
-	size_t x_add;
+	struct rowrun *run;
 
-	if (!editor->focused)
+	if (start >= end || (bgcolor == editor->bgcolor && !ctrl))
 		return;
-	if (editor->cursor->row != row)
+
+	if (editor->nruns > 0) {
+		run = &editor->runs[editor->nruns - 1];
+		if (run->end == start && run->bgcolor == bgcolor &&
+		    !run->ctrl && !ctrl) {
+			run->end = end;
+			return;
+		}
+	}
+
+	if (editor->nruns == editor->runs_alloc)
+		if (grow_array((void **) &editor->runs, sizeof(*editor->runs),
+		    &editor->runs_alloc) == -1)
+			err(1, "grow_array");
+
+	run = &editor->runs[editor->nruns++];
+	run->start = start;
+	run->end = end;
+	run->bgcolor = bgcolor;
+	run->ctrl = ctrl;
+}
+
+/*
+ * Finds next match of the search string starting from 'offset'.
+ */
+static int
+editor_next_match(struct editor *editor, const char *s, size_t len,
+    size_t offset, size_t *start)
+{
+	for (; offset + editor->search_len <= len; offset++) {
+		if (s[offset] == editor->search[0] && memcmp(&s[offset],
+		    editor->search, editor->search_len) == 0) {
+			*start = offset;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Builds ordered, non-overlapping list of style runs for the row from
+ * cursor, selection, output cursor, control characters and search
+ * matches, in that order of priority. Bytes not covered by any run use
+ * the editor background. A cursor at the end of row is a run that
+ * begins at the row length. Only bytes from 'wbegin' to 'wend' are
+ * considered so that long rows cost only what is visible.
+ */
+static void
+editor_row_runs(struct editor *editor, size_t row, const char *s,
+    size_t len, size_t wbegin, size_t wend)
+{
+	struct rowrun ov[3];
+	size_t pos, next, j, k, ms, me, from, to, mlen;
+	int i, bgcolor, overlay, has_match, eol_cursor;
+
+	editor->nruns = 0;
+	memset(ov, 0, sizeof(ov));
+	eol_cursor = 0;
+
+	if (editor->focused && editor->cursor->row == row) {
+		ov[0].start = ov[0].end = editor->cursor->offset;
+		if (ov[0].start < len)
+			utf8_incr_col(s, len, &ov[0].end, NULL);
+		else
+			eol_cursor = 1;
+		ov[0].bgcolor = COLOR_TEXT_CURSOR;
+	}
+
+	if (buffer_marked_range(editor->buffer, row, editor->cursor->row,
+	    editor->cursor->offset, &from, &to)) {
+		ov[1].start = from;
+		ov[1].end = MIN(to, len);
+		ov[1].bgcolor = COLOR_TEXT_SELECTION;
+	}
+
+	if (editor->focused && editor->ocursor != NULL &&
+	    editor->ocursor->row == row && editor->ocursor->offset < len) {
+		ov[2].start = ov[2].end = editor->ocursor->offset;
+		utf8_incr_col(s, len, &ov[2].end, NULL);
+		ov[2].bgcolor = COLOR_TEXT_OUTPUT_CURSOR;
+	}
+
+	/*
+	 * Matches may begin before the window and end after it.
+	 */
+	ms = me = 0;
+	has_match = 0;
+	mlen = MIN(len, wend + editor->search_len);
+	if (editor->search_len > 0 && (has_match = editor_next_match(editor,
+	    s, mlen, wbegin > editor->search_len ?
+	    wbegin - editor->search_len : 0, &ms)))
+		me = ms + editor->search_len;
+
+	pos = wbegin;
+	while (pos < wend) {
+		bgcolor = -1;
+		next = wend;
+		for (i = 0; i < ARRLEN(ov); i++) {
+			if (ov[i].start >= ov[i].end)
+				continue;
+			if (pos >= ov[i].start && pos < ov[i].end) {
+				if (bgcolor == -1) {
+					bgcolor = ov[i].bgcolor;
+					next = MIN(next, ov[i].end);
+				}
+			} else if (ov[i].start > pos)
+				next = MIN(next, ov[i].start);
+		}
+		overlay = (bgcolor != -1);
+
+		if (!overlay && has_match) {
+			while (has_match && me <= pos)
+				if ((has_match = editor_next_match(editor, s,
+				    mlen, me, &ms)))
+					me = ms + editor->search_len;
+			if (has_match && ms <= pos) {
+				bgcolor = COLOR_TEXT_SEARCH;
+				next = MIN(next, me);
+			} else if (has_match)
+				next = MIN(next, ms);
+		}
+
+		if (bgcolor == -1)
+			bgcolor = editor->bgcolor;
+
+		/*
+		 * Control characters get their own runs because they are
+		 * drawn one by one.
+		 */
+		for (k = j = pos; j < next; j++) {
+			if (s[j] == '\t' || !iscntrl((unsigned char) s[j]))
+				continue;
+			editor_add_run(editor, k, j, bgcolor, 0);
+			editor_add_run(editor, j, j + 1,
+			    overlay ? bgcolor : COLOR_TEXT_CTRL, 1);
+			k = j + 1;
+		}
+		editor_add_run(editor, k, next, bgcolor, 0);
+		pos = next;
+	}
+
+	if (eol_cursor && wend == len)
+		editor_add_run(editor, len, len + 1, COLOR_TEXT_CURSOR, 0);
+}
+
+/*
+ * Part of row that needs to be looked at for drawing. 'x' is the pixel
+ * position of 'begin' from the beginning of row.
+ */
+struct rowview {
+	size_t	begin;
+	size_t	end;
+	int	x;
+};
+
+/*
+ * Finds out the bytes of the row needed for drawing pixels from
+ * 'px_from' to 'px_to', relative to the beginning of row, and builds
+ * the style runs for them. Short rows are taken whole.
+ */
+static void
+editor_prepare_row(struct editor *editor, int row, const char *s,
+    size_t len, int px_from, int px_to, struct rowview *view)
+{
+	struct hindex *h;
+	struct checkpoint *cp;
+
+	view->begin = 0;
+	view->end = len;
+	view->x = 0;
+	if ((h = editor_hindex(editor, row, s, len)) != NULL) {
+		cp = editor_hindex_seek_x(h, s, len, px_from);
+		view->begin = cp->offset;
+		view->x = cp->x;
+		cp = editor_hindex_seek_x(h, s, len, px_to);
+		if (cp + 1 < &h->cps[h->ncps])
+			view->end = cp[1].offset;
+	}
+
+	editor_row_runs(editor, row, s, len, view->begin, view->end);
+}
+
+static void
+editor_draw_eol_cursor(struct editor *editor, XftDraw *target, size_t *x,
+    int *sx, size_t y, size_t orig_len)
+{
+	struct rowrun *run;
+	size_t x_add;
+
+	if (editor->nruns == 0)
 		return;
-	if (editor->cursor->offset != orig_len)
+	run = &editor->runs[editor->nruns - 1];
+	if (run->start != orig_len)
 		return;
 
-	font_set_bgcolor(COLOR_TEXT_CURSOR);
-	x_add = font_draw(editor->window, *x, *sx, y, " ", 1);
+	font_set_bgcolor(run->bgcolor);
+	x_add = font_draw(target, *x, *sx, y, " ", 1);
 	*x += x_add;
 	*sx += x_add;
 }
 
+/*
+ * Draws chunk of a line, or just steps over it if it lies completely
+ * left from 'clip'.
+ */
 static void
-editor_draw_chunk(struct editor *editor, size_t *x, int *sx,
-    size_t y, const char *src, size_t len, int bgcolor)
+editor_draw_chunk(struct editor *editor, XftDraw *target, int clip,
+    size_t *x, int *sx, size_t y, const char *src, size_t len, int bgcolor)
 {
 	const char *s;	
 	char ch;
 	size_t x_add;
 
-	font_set_bgcolor(bgcolor);
-
 	/*
 	 * If we stepped on an invisible control character, draw it in
 	 * a way that conveys some information because control characters
@@ -1138,187 +2289,445 @@ editor_draw_chunk(struct editor *editor, size_t *x, int *sx,
 	} else
 		s = src;
 
-	x_add = font_draw(editor->window, *x, *sx, y, s, len);
+	if (*sx >= clip ||
+	    *sx + (int) (x_add = font_str_width(*x, s, len)) > clip) {
+		font_set_bgcolor(bgcolor);
+		x_add = font_draw(target, *x, *sx, y, s, len);
+	}
 	*x += x_add;
 	*sx += x_add;
 }
 
 /*
- * Draws and colors line, or part of line.
+ * Draws and colors line, or part of line, according to the style runs
+ * built by editor_row_runs(). 'dst' holds 'len' bytes of the row
+ * starting from 'orig_offset'.
  *
  * Assumes valid UTF-8 e.g. data is preprocessed and checked for errors
  * before entering here.
  */
 static void
-editor_draw_line(struct editor *editor, size_t *x, int *sx, size_t row,
-    size_t y, const char *dst, size_t len, size_t orig_offset,
-    size_t orig_len)
+editor_draw_line(struct editor *editor, XftDraw *target, int from, int to,
+    size_t *x, int *sx, size_t y, const char *dst, size_t len,
+    size_t orig_offset)
 {
-	size_t j, k;
-	int bgcolor, want_bgcolor, step_ctrl, error;
+	struct rowrun *run, *end;
+	size_t pos, stop, k, n;
+	int bgcolor, ctrl;
 
 	if (dst == NULL || len == 0)
 		return;
 
-	j = 0;
-	k = 0;
-	bgcolor = editor->bgcolor;
-	want_bgcolor = editor->bgcolor;
-	step_ctrl = 0;
-	error = 0;
-	do {
-		/*
-		 * We shouldn't get UTF-8 errors here. If we do get,
-		 * it is an input validation error.
-		 */
-		assert(error == 0);
-
-		if (j >= len)
-			break;
-
-		if (editor->focused && row == editor->cursor->row &&
-		    j+orig_offset == editor->cursor->offset) {
-			want_bgcolor = COLOR_TEXT_CURSOR;
-		} else if (buffer_is_marked(
-		    editor->buffer, row, j+orig_offset, editor->cursor->row,
-		    editor->cursor->offset)) {
-			want_bgcolor = COLOR_TEXT_SELECTION;
-		} else if (editor->ocursor != NULL &&
-		    editor->focused && row == editor->ocursor->row &&
-		    j+orig_offset == editor->ocursor->offset) {
-			want_bgcolor = COLOR_TEXT_OUTPUT_CURSOR;
-		} else if (dst[j] != '\t' && iscntrl((unsigned char) dst[j])) {
-			want_bgcolor = COLOR_TEXT_CTRL;
-			step_ctrl = 1;
-		} else
-			want_bgcolor = editor->bgcolor;
+	run = editor_find_run(editor, orig_offset);
+	end = &editor->runs[editor->nruns];
+	pos = orig_offset;
+	while (pos < orig_offset + len && *sx < to) {
+		if (run < end && run->start <= pos) {
+			bgcolor = run->bgcolor;
+			ctrl = run->ctrl;
+			stop = MIN(run->end, orig_offset + len);
+		} else {
+			bgcolor = editor->bgcolor;
+			ctrl = 0;
+			stop = orig_offset + len;
+			if (run < end)
+				stop = MIN(run->start, stop);
+		}
 
 		/*
-		 * Dump chunk so far if we have state change, ctrl code,
-		 * or if the chunk grows large (so that we can limit
-		 * draws that exceed window width).
+		 * Limit chunk size so that we do not draw excessively
+		 * over the window width, but keep characters whole.
 		 */
-		if (want_bgcolor != bgcolor || step_ctrl ||
-		    j-k >= CHUNK_BREAK_LIMIT) {
-			step_ctrl = 0;
-			if (j-k > 0)
-				editor_draw_chunk(editor, x, sx, y,
-				    &dst[k], j-k, bgcolor);
-			bgcolor = want_bgcolor;
-			k=j;
+		for (k = pos; k < stop && *sx < to; k += n) {
+			n = stop - k;
+			if (n > CHUNK_BREAK_LIMIT) {
+				n = CHUNK_BREAK_LIMIT;
+				while (n > 1 && (dst[k - orig_offset + n] &
+				    0xc0) == 0x80)
+					n--;
+			}
+			assert(!ctrl || n == 1);
+			editor_draw_chunk(editor, target, from, x, sx, y,
+			    &dst[k - orig_offset], n, bgcolor);
 		}
-	} while (utf8_incr_col(dst, len, &j, &error) > 0 &&
-	    *sx < WIDGET_WIDTH(editor));
 
-	if (j-k > 0)
-		editor_draw_chunk(editor, x, sx, y, &dst[k], j-k, bgcolor);
+		pos = stop;
+		if (run < end && run->end <= pos)
+			run++;
+	}
 }
 
+/*
+ * Draws buffer row to the target starting from 'sx', and clears the rest
+ * up to 'to'. Only the area between 'from' and 'to' is guaranteed to be
+ * drawn. The row must have been prepared with editor_prepare_row().
+ */
 static void
-editor_draw(struct editor *editor, size_t from, size_t to)
+editor_draw_row(struct editor *editor, XftDraw *target, int from, int to,
+    int row, int y, int sx, const struct rowview *view)
 {
-	int i, y;
 	size_t x;
-	int sx;
-	size_t rows;
-#ifdef WANT_LINE_NUMBERS
-	char lineno[256];
-#endif
 	const char *dst;
 	size_t len, offset, orig_offset, orig_len;
 	int error;
 
+	x = view->x;
+	sx += view->x;
+	orig_offset = offset = view->begin;
+	orig_len = buffer_bytes_at(editor->buffer, row);
+	error = 0;
+	while (offset < view->end && (dst = buffer_u8str_break(editor->buffer,
+	    row, &offset, view->end - offset, &len, &error)) != NULL &&
+	    sx < to) {
+		if (error == 1 && len > 0)
+			len--;
+		editor_draw_line(editor, target, from, to, &x, &sx, y,
+		    dst, len, orig_offset);
+		if (error == 1 && sx < to)
+			editor_draw_chunk(editor, target, from, &x, &sx, y,
+			    "\xef\xbf\xbd", 3,
+			    editor_run_color(editor, orig_offset + len));
+		orig_offset = offset;
+	}
+	editor_draw_eol_cursor(editor, target, &x, &sx, y, orig_len);
+
+	if (sx < from)
+		sx = from;
+	if (to-sx > 0) {
+		font_set_bgcolor(editor->bgcolor);
+		font_clear(target, sx, y, to - sx);
+	}
+}
+
+/*
+ * Draws display lines of the row that are visible, the first of them
+ * at 'y'. Continuation lines have no line number.
+ */
+static void
+editor_draw_wrapped_row(struct editor *editor, XftDraw *ftdraw, int row,
+    int y)
+{
+	struct rowview view;
+	const char *s;
+	size_t len, n, sub;
+	int gutter;
+
+	gutter = editor_gutter_width(editor);
+	if ((s = buffer_u8str_at(editor->buffer, row, &len)) == NULL)
+		len = 0;
+
+	n = editor_wrap_breaks(editor, row);
+	for (sub = 0; sub < n && y < WIDGET_HEIGHT(editor);
+	    sub++, y += font_height()) {
+		if (y < 0)
+			continue;
+
+		view.begin = editor->breaks[sub];
+		view.end = sub + 1 < n ? editor->breaks[sub + 1] : len;
+		view.x = 0;
+		editor_row_runs(editor, row, s, len, view.begin, view.end);
+		editor_draw_row(editor, ftdraw, gutter, WIDGET_WIDTH(editor),
+		    row, y, gutter, &view);
+
+		if (sub > 0 && gutter > 0) {
+			font_set_bgcolor(COLOR_TEXT_LINENO);
+			font_clear(ftdraw, 0, y, gutter);
+		}
+	}
+}
+
+#ifdef WANT_LINE_NUMBERS
+#define GUTTER_EXISTS	(1 << 0)
+#define GUTTER_CMDLINE	(1 << 1)
+#define GUTTER_PAGE	(1 << 2)
+
+/*
+ * Line numbers are rendered to a Pixmap that has a slot for each visible
+ * row. Row 'i' lives in slot 'i % nslots', so that rows keep their slots
+ * while scrolling and need to be rendered only once.
+ */
+struct gutterslot {
+	long	row;
+	int	flags;
+};
+
+/*
+ * Computes gutter width from the number of digits in the largest row
+ * number that can be visible. Returns 1 if the width changed.
+ */
+static int
+editor_update_gutter(struct editor *editor)
+{
+	char s[32];
+	size_t rows;
+	int digits, width;
+
+	rows = MAX(buffer_rows(editor->buffer),
+	    (size_t) editor->bottom_row + 1);
+	digits = snprintf(s, sizeof(s), "%zu", rows);
+	if (digits == editor->gutter_digits)
+		return 0;
+	editor->gutter_digits = digits;
+
+	memset(s, '0', digits);
+	memcpy(&s[digits], "-> ", 3);
 	font_set(FONT_NORMAL);
-	font_set_fgcolor(COLOR_TEXT_FG);
+	width = font_str_width(0, s, digits + 3);
+	if (width == editor->gutter_width)
+		return 0;
+
+	editor->gutter_width = width;
+	editor_gutter_free(editor);
+	return 1;
+}
+
+static void
+editor_gutter_free(struct editor *editor)
+{
+	extern struct dpy *dpy;
+
+	if (editor->gutter_ftdraw != NULL) {
+		font_free_ftdraw(editor->gutter_ftdraw);
+		editor->gutter_ftdraw = NULL;
+	}
+	if (editor->gutter != None) {
+		XFreePixmap(DPY(dpy), editor->gutter);
+		editor->gutter = None;
+	}
+	editor->gutter_nslots = 0;
+}
+
+/*
+ * Makes sure there is a gutter slot for each visible row.
+ */
+static void
+editor_gutter_alloc(struct editor *editor)
+{
+	extern struct dpy *dpy;
+	size_t i, nslots;
+
+	nslots = editor->bottom_row - editor->top_row + 1;
+	if (editor->gutter != None && editor->gutter_nslots == nslots)
+		return;
+
+	editor_gutter_free(editor);
+	while (editor->gutter_alloc < nslots)
+		if (grow_array((void **) &editor->gutter_slots,
+		    sizeof(*editor->gutter_slots), &editor->gutter_alloc) == -1)
+			err(1, "grow_array");
+
+	editor->gutter = XCreatePixmap(DPY(dpy), editor->window,
+	    editor->gutter_width, nslots * font_height(),
+	    DefaultDepth(DPY(dpy), DPY_SCREEN(dpy)));
+	editor->gutter_ftdraw = font_create_ftdraw(editor->gutter);
+	editor->gutter_nslots = nslots;
+
+	for (i = 0; i < nslots; i++)
+		editor->gutter_slots[i].row = -1;
+}
+
+static void
+editor_draw_gutter(struct editor *editor, size_t from, size_t to)
+{
+	int i, y, sy, flags;
+	size_t x, rows, nslots;
+	char lineno[256];
+	struct gutterslot *slot;
 
+	font_set(FONT_NORMAL);
 	rows = buffer_rows(editor->buffer);
 
-	font_set_bgcolor(editor->bgcolor);
-	font_set_fgcolor(COLOR_TEXT_FG);
+	editor_gutter_alloc(editor);
+	nslots = editor->gutter_nslots;
+
+	font_set_bgcolor(COLOR_TEXT_LINENO);
 	for (i = from; i <= to; i++) {
 		if (i < editor->top_row)
 			continue;
 		if (i > editor->bottom_row)
 			continue;
 
-#ifdef WANT_LINE_NUMBERS
-		sx = 100;
-#else
-		sx = 0;
-#endif
-		x = 0;
-		y = (i - editor->top_row) * font_height();
-		sx -= editor->begin_offset;
+		y = editor_row_y(editor, i);
 
-		if (y >= WIDGET_HEIGHT(editor))
+		if (y < 0 || y >= WIDGET_HEIGHT(editor))
 			continue;
 
+		flags = 0;
 		if (i < rows) {
-			orig_offset = offset = 0;
-			orig_len = buffer_bytes_at(editor->buffer, i);
-			error = 0;
-			while ((dst = buffer_u8str_break(editor->buffer, i,
-			    &offset, &len, &error)) != NULL && sx <
-			    WIDGET_WIDTH(editor)) {
-				if (error == 1 && len > 0)
-					len--;
-				editor_draw_line(editor, &x, &sx, i, y,
-				    dst, len, orig_offset, orig_len);
-				if (error == 1) {
-					editor_draw_line(editor, &x, &sx, i,
-					    y, "\xef\xbf\xbd", 3,
-					    orig_offset+len,
-					    orig_len);
-				}
-				orig_offset = offset;
-			}
-			editor_draw_eol_cursor(editor, &x, &sx, i, y,
-			    orig_len);
+			flags |= GUTTER_EXISTS;
+			if (buffer_row_uflags(editor->buffer, i) &
+			    ROW_UFLAGS_CMDLINE)
+				flags |= GUTTER_CMDLINE;
+			if (i % nslots == 0)
+				flags |= GUTTER_PAGE;
 		}
 
-		if (WIDGET_WIDTH(editor)-sx > 0) {
-			font_set_bgcolor(editor->bgcolor);
-			font_clear(editor->window, sx, y,
-			    WIDGET_WIDTH(editor) - sx);
+		slot = &editor->gutter_slots[i % nslots];
+		sy = (i % nslots) * font_height();
+		if (slot->row != i || slot->flags != flags) {
+			if (flags & GUTTER_CMDLINE)
+				font_set_fgcolor(COLOR_TEXT_CURSOR);
+			else
+				font_set_fgcolor(COLOR_TEXT_FG);
+
+			if (flags & GUTTER_PAGE)
+				snprintf(lineno, sizeof(lineno), "%d->", i + 1);
+			else if (flags & GUTTER_EXISTS)
+				snprintf(lineno, sizeof(lineno), "%d", i + 1);
+			else
+				snprintf(lineno, sizeof(lineno), "~");
+
+			x = font_draw(editor->gutter_ftdraw, 0, 0, sy, lineno,
+			    strlen(lineno));
+			if (x < editor->gutter_width)
+				font_clear(editor->gutter_ftdraw, x, sy,
+				    editor->gutter_width - x);
+
+			slot->row = i;
+			slot->flags = flags;
 		}
+
+		XCopyArea(DPY(editor->dpy), editor->gutter, editor->window,
+		    editor->blit_gc, 0, sy, editor->gutter_width,
+		    font_height(), 0, y);
 	}
+}
+#endif
+
+static int
+editor_gutter_width(struct editor *editor)
+{
+	return editor->gutter_width;
+}
+
+/*
+ * Fills in the row cache key i.e. everything that affects how the
+ * row looks like. Style runs for the row must have been built.
+ */
+static void
+editor_row_key(struct editor *editor, const char *s, size_t len, int width,
+    struct rowkey *key)
+{
+	key->bytes = s;
+	key->len = len;
+	key->begin_offset = editor->begin_offset;
+	key->width = width;
+	key->height = font_height();
+	key->font = FONT_NORMAL;
+	key->bgcolor = editor->bgcolor;
+	key->runs = editor->runs;
+	key->nruns = editor->nruns;
+}
+
+/*
+ * Rows that are found from the row cache are copied to the window, and
+ * the rest are rendered to the cache first. Rows that are not eligible
+ * for caching are drawn directly.
+ */
+static void
+editor_draw(struct editor *editor, size_t from, size_t to)
+{
+	int i, y, gutter, width;
+	size_t rows, len;
+	const char *s;
+	struct rowkey key;
+	struct rowview view;
+	Pixmap pixmap;
+	XftDraw *ftdraw, *pixmap_ftdraw;
+#ifdef USE_SHM_RENDER
+	int shm;
+#endif
+
+	font_set(FONT_NORMAL);
+
+	rows = buffer_rows(editor->buffer);
+	ftdraw = widget_ftdraw(WIDGET(editor));
+
+	/*
+	 * If gutter width changes, everything moves.
+	 */
+	if (editor_update_gutter(editor)) {
+		if (editor->wrapindex != NULL)
+			editor_wrap_layout(editor);
+		from = editor->top_row;
+		to = editor->bottom_row;
+	} else if (editor->wrapindex != NULL)
+		editor_wrap_layout(editor);
+	gutter = editor_gutter_width(editor);
+	width = WIDGET_WIDTH(editor) - gutter;
+
+	font_set_bgcolor(editor->bgcolor);
+	font_set_fgcolor(COLOR_TEXT_FG);
+
+#ifdef USE_SHM_RENDER
+	/*
+	 * Repaints of the whole view are rendered on the client side and
+	 * sent at once, which beats the row cache when everything changes.
+	 */
+	shm = from <= editor->top_row && to >= editor->bottom_row &&
+	    shmrender_begin(ftdraw, WIDGET_WIDTH(editor),
+	    WIDGET_HEIGHT(editor)) == 0;
+	if (shm)
+		for (y = 0; y < WIDGET_HEIGHT(editor); y += font_height())
+			font_clear(ftdraw, 0, y, WIDGET_WIDTH(editor));
+#endif
 
-#ifdef WANT_LINE_NUMBERS
-	font_set_bgcolor(COLOR_TEXT_LINENO);
 	for (i = from; i <= to; i++) {
 		if (i < editor->top_row)
 			continue;
 		if (i > editor->bottom_row)
 			continue;
 
-		x = 0;
-		y = (i - editor->top_row) * font_height();
+		y = editor_row_y(editor, i);
 
 		if (y >= WIDGET_HEIGHT(editor))
 			continue;
 
-		if (buffer_row_uflags(editor->buffer, i) & ROW_UFLAGS_CMDLINE)
-			font_set_fgcolor(COLOR_TEXT_CURSOR);
-		else
-			font_set_fgcolor(COLOR_TEXT_FG);
+		if (i >= rows) {
+			font_set_bgcolor(editor->bgcolor);
+			font_clear(ftdraw, gutter, y, width);
+			continue;
+		}
 
-		/*
-		 * TODO: Implement minimum WIDGET_HEIGHT because this can
-		 *       result in floating point exception because this
-		 *       can become i % 0.
-		 */
-		if (i < rows &&
-		    i % (WIDGET_HEIGHT(editor) / font_height()) == 0)
-			snprintf(lineno, sizeof(lineno), "%d->", i + 1);
-		else if (i < rows)
-			snprintf(lineno, sizeof(lineno), "%d", i + 1);
+		if (editor->wrapindex != NULL) {
+			editor_draw_wrapped_row(editor, ftdraw, i, y);
+			continue;
+		}
+
+		if ((s = buffer_u8str_at(editor->buffer, i, &len)) == NULL)
+			len = 0;
+		editor_prepare_row(editor, i, s, len, editor->begin_offset,
+		    editor->begin_offset + width, &view);
+#ifdef USE_SHM_RENDER
+		if (shm) {
+			editor_draw_row(editor, ftdraw, gutter,
+			    WIDGET_WIDTH(editor), i, y,
+			    gutter - editor->begin_offset, &view);
+			continue;
+		}
+#endif
+		editor_row_key(editor, s, len, width, &key);
+		if ((pixmap = rowcache_lookup(&key)) == None &&
+		    (pixmap = rowcache_insert(&key, &pixmap_ftdraw)) != None)
+			editor_draw_row(editor, pixmap_ftdraw, 0, width, i, 0,
+			    -editor->begin_offset, &view);
+
+		if (pixmap != None)
+			rowcache_put(pixmap, editor->window, gutter, y, width,
+			    key.height);
 		else
-			snprintf(lineno, sizeof(lineno), "~");
-		x += font_draw(editor->window, x, x, y, lineno,
-		    strlen(lineno));
-		if (x < 100)
-			font_clear(editor->window, x, y, 100 - x);
+			editor_draw_row(editor, ftdraw, gutter,
+			    WIDGET_WIDTH(editor), i, y,
+			    gutter - editor->begin_offset, &view);
 	}
+
+#ifdef USE_SHM_RENDER
+	if (shm)
+		shmrender_end(editor->window, editor->blit_gc, 0, 0);
+#endif
+
+#ifdef WANT_LINE_NUMBERS
+	editor_draw_gutter(editor, from, to);
 #endif
 
 	y = (WIDGET_HEIGHT(editor) / font_height()) * font_height();
@@ -1329,16 +2738,56 @@ editor_draw(struct editor *editor, size_t from, size_t to)
 	}
 }
 
+/*
+ * Draws visible rows only between 'from' and 'to' pixels horizontally,
+ * bypassing the row cache.
+ */
+static void
+editor_draw_strip(struct editor *editor, int from, int to)
+{
+	int i, y, gutter;
+	size_t rows, len;
+	const char *p;
+	struct rowview view;
+	XftDraw *ftdraw;
+
+	font_set(FONT_NORMAL);
+
+	rows = buffer_rows(editor->buffer);
+	gutter = editor_gutter_width(editor);
+	ftdraw = widget_ftdraw(WIDGET(editor));
+
+	/*
+	 * Chunks that begin left from the strip would otherwise be drawn
+	 * over the contents we just moved, or over the line numbers.
+	 */
+	font_set_clip(ftdraw, from, 0, to - from, WIDGET_HEIGHT(editor));
+
+	font_set_bgcolor(editor->bgcolor);
+	font_set_fgcolor(COLOR_TEXT_FG);
+	for (i = editor->top_row; i <= editor->bottom_row && i < rows; i++) {
+		y = (i - editor->top_row) * font_height();
+		if (y >= WIDGET_HEIGHT(editor))
+			break;
+		if ((p = buffer_u8str_at(editor->buffer, i, &len)) == NULL)
+			len = 0;
+		editor_prepare_row(editor, i, p, len,
+		    from - gutter + editor->begin_offset,
+		    to - gutter + editor->begin_offset, &view);
+		editor_draw_row(editor, ftdraw, from, to, i, y,
+		    gutter - editor->begin_offset, &view);
+	}
+	font_clear_clip(ftdraw);
+}
+
 static void
 editor_expose(int x, int y, int width, int height, void *udata)
 {
 	struct editor *editor = udata;
 	int from, to;
-	int lines;
 
-	lines = (int) ceil(height / (double) font_height());
-	from = editor->top_row + (y / font_height());
-	assert(lines > 0);
-	to = from + (lines-1);
+	assert(height > 0);
+	from = editor_row_at_y(editor, y);
+	to = editor_row_at_y(editor, y + height - 1);
 	editor_draw(editor, from, to);
 }
@@ -19,15 +19,36 @@
 #define EDITOR_H
 
 #include <X11/Xlib.h>
+#include <X11/Xft/Xft.h>
 
 struct cursor;
 struct dpy;
 struct widget;
+struct gutterslot;
+struct rowrun;
+struct checkpoint;
+struct wrapindex;
 
 
 typedef void (*EditSubmitHandler)(const char *, void *);
 typedef int (*EditResizeHandler)(Window, int *, int *, void *);
 typedef void (*EditExecHandler)(const char *, int x, int y, void *);
+typedef void (*EditTailHandler)(void *);
+
+/*
+ * Sparse byte offset to pixel position checkpoints for a long row.
+ */
+struct hindex {
+	int			 row;
+	size_t			 len;
+	unsigned long		 used;
+	struct checkpoint	*cps;
+	size_t			 ncps;
+	size_t			 alloc;
+	int			 done;
+};
+
+#define EDITOR_HINDEX 4
 
 typedef enum prompt_action {
 	PROMPT_ACTION_NONE,
@@ -39,6 +60,7 @@ typedef enum prompt_action {
 struct editor {
 	Window			 window;
 	GC			 gc;
+	GC			 blit_gc;
 	struct buffer		*buffer;
 	struct cursor		*cursor;
 	struct cursor		*ocursor;
@@ -46,6 +68,8 @@ struct editor {
 	void			*submit_udata;
 	EditExecHandler		 exec;
 	void			*exec_udata;
+	EditTailHandler		 tail;
+	void			*tail_udata;
 	EditResizeHandler	 resize;
 	void			*resize_udata;
 	int			 focused;
@@ -59,6 +83,37 @@ struct editor {
 	int			 largest_height;
 	int			 x_on;
 	int			 prefer_offset;
+	int			 dirty_hidden;
+	int			 follow;
+	int			 pinned;
+
+	struct rowrun		*runs;
+	size_t			 nruns;
+	size_t			 runs_alloc;
+
+	char			*search;
+	size_t			 search_len;
+
+	struct hindex		 hindex[EDITOR_HINDEX];
+	unsigned long		 hindex_tick;
+
+	struct wrapindex	*wrapindex;
+	int			 top_sub;
+	int			 bottom_sub;
+	int			 wrap_width;
+	int			 wrap_from;
+	size_t			*breaks;
+	size_t			 nbreaks;
+	size_t			 breaks_alloc;
+	int			 breaks_row;
+
+	int			 gutter_width;
+	int			 gutter_digits;
+	Pixmap			 gutter;
+	XftDraw			*gutter_ftdraw;
+	struct gutterslot	*gutter_slots;
+	size_t			 gutter_nslots;
+	size_t			 gutter_alloc;
 
 	/* TODO: Could combine these prompt things to their own struct */
 	struct buffer		*prompt_buffer;
@@ -79,6 +134,8 @@ struct editor	*editor_create(struct dpy *, struct cursor *,
 		    EditSubmitHandler, void *, int, int, int, const char *,
 		    struct widget *);
 void		 editor_shrink(struct editor *);
+void		 editor_set_follow(struct editor *, int);
+int		 editor_rows_behind(struct editor *);
 void		 editor_free(struct editor *);
 
 #endif
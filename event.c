@@ -18,54 +18,213 @@
 #include "util.h"
 #include "event.h"
 #include "xevent.h"
+#include "config.h"
 
 #include <assert.h>
-#include <sys/select.h>
 #include <err.h>
+#include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <limits.h>
 
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
+#include <poll.h>
+
+/*
+ * Sources stay registered with the kernel between iterations. 'gen'
+ * tells apart a source from an earlier one with the same fd number,
+ * in case a handler removes a source and another one reuses the fd
+ * before the events already returned have been dispatched.
+ */
 struct event_source {
 	int fd;
+	unsigned int gen;
+	int priority;
+	int enabled;
+	unsigned long served;
 	void *udata;
 	EventHandler handler;
 };
 
-struct idle_handler {
+/*
+ * Idle handlers are render priority tasks that run on every iteration
+ * and never finish. Cancelled tasks are marked dead and removed after
+ * the current run, as tasks may cancel others while running.
+ */
+struct task {
+	int id;
+	int priority;
+	int dead;
+	TaskHandler handler;
+	IdleHandler idle;
 	void *udata;
-	IdleHandler handler;
+};
+
+struct ready {
+	int fd;
+	unsigned int gen;
 };
 
 static struct event_source *sources;
 static size_t n_sources;
 static size_t max_sources;
+static unsigned int source_gen;
+
+/* Index + 1 to sources by fd, 0 if not registered. */
+static size_t *slots;
+static size_t max_slots;
+
+static struct ready *ready;
+static size_t max_ready;
+
+/* Rounds of dispatching so far and what the last handler reported. */
+static unsigned long rounds;
+static size_t consumed;
+static int more;
+
+#ifdef HAVE_EPOLL
+static int epfd = -1;
+static struct epoll_event *epevents;
+static size_t max_epevents;
+#else
+static struct pollfd *pfds;
+static size_t max_pfds;
+#endif
 
-static struct idle_handler *idles;
-static size_t n_idles;
-static size_t max_idles;
+static struct task *tasks;
+static size_t n_tasks;
+static size_t max_tasks;
+static int task_id;
+static int tasks_pending;
+static size_t next_background;
+static int tasks_running;
+static uint64_t slice_end;
+
+/*
+ * One-shot timers in a binary min-heap ordered by deadline, which is
+ * in nanoseconds of CLOCK_MONOTONIC.
+ */
+struct timer {
+	uint64_t deadline;
+	int id;
+	TimerHandler handler;
+	void *udata;
+};
+
+static struct timer *timers;
+static size_t n_timers;
+static size_t max_timers;
+static int timer_id;
+
+static int	 set_slot(int, size_t);
+static struct event_source *find_source(int, unsigned int);
+static size_t	 wait_sources(void);
+static int	 compare_served(const void *, const void *);
+static long	 elapsed_ms(const struct timespec *);
+static void	 dispatch_budgeted(struct ready *);
+static void	 dispatch_high(void);
+static void	 dispatch_ready(size_t);
+static uint64_t	 now_ns(void);
+static void	 timer_swap(size_t, size_t);
+static void	 timer_up(size_t);
+static void	 timer_down(size_t);
+static void	 timer_remove_at(size_t);
+static int	 timer_timeout(void);
+static void	 run_timers(void);
+static int	 new_task(int, TaskHandler, IdleHandler, void *);
+static void	 run_task(size_t);
+static void	 run_tasks(int);
+static void	 compact_tasks(void);
+
+static int
+set_slot(int fd, size_t slot)
+{
+	size_t old;
+
+	while (fd >= max_slots) {
+		old = max_slots;
+		if (grow_array((void **) &slots, sizeof(*slots),
+		    &max_slots) == -1)
+			return -1;
+		memset(&slots[old], 0, (max_slots - old) * sizeof(*slots));
+	}
+
+	slots[fd] = slot;
+	return 0;
+}
 
 int
 add_event_source(int fd, EventHandler handler, void *udata)
 {
+#ifdef HAVE_EPOLL
+	struct epoll_event ev;
+#endif
+
+	assert(fd >= 0);
+
 	if (max_sources == n_sources)
 		if (grow_array((void **) &sources, sizeof(*sources),
 		    &max_sources) == -1)
 			return -1;
 
-	sources[n_sources++] = (struct event_source) { fd, udata, handler };
+	if (set_slot(fd, n_sources + 1) == -1)
+		return -1;
+
+	sources[n_sources] = (struct event_source) { fd, ++source_gen,
+	    EVENT_PRIORITY_NORMAL, 1, 0, udata, handler };
+
+#ifdef HAVE_EPOLL
+	if (epfd == -1 && (epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		err(1, "epoll_create1");
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = (uint64_t) source_gen << 32 | (uint32_t) fd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		slots[fd] = 0;
+		return -1;
+	}
+#else
+	if (max_pfds < max_sources) {
+		max_pfds = max_sources;
+		if ((pfds = realloc(pfds, max_pfds * sizeof(*pfds))) == NULL)
+			err(1, "realloc");
+	}
+	pfds[n_sources] = (struct pollfd) { fd, POLLIN, 0 };
+#endif
+
+	n_sources++;
 	return 0;
 }
 
-int
-add_idle_handler(IdleHandler handler, void *udata)
+static int
+new_task(int priority, TaskHandler handler, IdleHandler idle, void *udata)
 {
-	if (max_idles == n_idles)
-		if (grow_array((void **) &idles, sizeof(*idles),
-		    &max_idles) == -1)
+	if (max_tasks == n_tasks)
+		if (grow_array((void **) &tasks, sizeof(*tasks),
+		    &max_tasks) == -1)
 			return -1;
 
-	idles[n_idles++] = (struct idle_handler) { udata, handler };
-	return 0;
+	if (++task_id <= 0)
+		task_id = 1;
+
+	tasks[n_tasks++] = (struct task) { task_id, priority, 0, handler,
+	    idle, udata };
+	if (handler != NULL)
+		tasks_pending = 1;
+	return task_id;
+}
+
+int
+add_idle_handler(IdleHandler handler, void *udata)
+{
+	return new_task(TASK_PRIORITY_RENDER, NULL, handler, udata) == -1 ?
+	    -1 : 0;
 }
 
 void
@@ -73,24 +232,112 @@ remove_idle_handler(IdleHandler handler, void *udata)
 {
 	size_t i;
 
-	for (i = 0; i < n_idles; i++)
-		if (idles[i].handler == handler && idles[i].udata == udata)
-			break;
+	for (i = 0; i < n_tasks; i++)
+		if (!tasks[i].dead && tasks[i].idle == handler &&
+		    tasks[i].udata == udata) {
+			tasks[i].dead = 1;
+			return;
+		}
+}
+
+/*
+ * Adds a job that is called repeatedly until it returns TASK_DONE.
+ * Each call should do a bounded amount of work and return TASK_MORE
+ * as soon as task_should_yield() says so. Input tasks run before
+ * drawing, and background tasks share a time slice per iteration and
+ * only run when there is time left. Returns an id for cancel_task(),
+ * or -1 on error.
+ */
+int
+add_task(int priority, TaskHandler handler, void *udata)
+{
+	return new_task(priority, handler, NULL, udata);
+}
 
-	if (i == n_idles)
+void
+cancel_task(int id)
+{
+	size_t i;
+
+	for (i = 0; i < n_tasks; i++)
+		if (tasks[i].id == id) {
+			tasks[i].dead = 1;
+			return;
+		}
+}
+
+int
+task_should_yield(void)
+{
+	return now_ns() >= slice_end;
+}
+
+static void
+run_task(size_t i)
+{
+	struct task task;
+
+	task = tasks[i];
+	if (task.idle != NULL) {
+		task.idle(task.udata);
 		return;
+	}
 
-	if (i+1 < n_idles)
-		memmove(&idles[i], &idles[i+1], (n_idles - i) *
-		    sizeof(struct idle_handler));
-	n_idles--;
-	if (n_idles == 0) {
-		if (max_idles > 0) {
-			free(idles);
-			idles = NULL;
-			max_sources = 0;
+	slice_end = now_ns() + (uint64_t) TASK_SLICE_MS * 1000000;
+	if (task.handler(task.udata) == TASK_DONE)
+		tasks[i].dead = 1;
+}
+
+static void
+compact_tasks(void)
+{
+	size_t i, j;
+
+	tasks_pending = 0;
+	for (i = 0, j = 0; i < n_tasks; i++) {
+		if (tasks[i].dead)
+			continue;
+		if (tasks[i].handler != NULL)
+			tasks_pending = 1;
+		tasks[j++] = tasks[i];
+	}
+	n_tasks = j;
+}
+
+/*
+ * Runs tasks up to priority 'max' in priority order. Background tasks
+ * are served round-robin until their shared slice runs out.
+ */
+static void
+run_tasks(int max)
+{
+	uint64_t end;
+	size_t i, n, k;
+	int priority;
+
+	tasks_running++;
+	n = n_tasks;
+	for (priority = TASK_PRIORITY_INPUT; priority <= max &&
+	    priority < TASK_PRIORITY_BACKGROUND; priority++)
+		for (i = 0; i < n; i++)
+			if (!tasks[i].dead && tasks[i].priority == priority)
+				run_task(i);
+
+	if (max >= TASK_PRIORITY_BACKGROUND) {
+		end = now_ns() + (uint64_t) TASK_SLICE_MS * 1000000;
+		for (k = 0; k < n && now_ns() < end; k++) {
+			i = (next_background + k) % n;
+			if (tasks[i].dead ||
+			    tasks[i].priority != TASK_PRIORITY_BACKGROUND)
+				continue;
+			run_task(i);
+			next_background = i + 1;
 		}
 	}
+
+	/* Tasks may dispatch X events, which runs tasks again. */
+	if (--tasks_running == 0)
+		compact_tasks();
 }
 
 void
@@ -98,17 +345,28 @@ remove_event_source(int fd)
 {
 	size_t i;
 
-	for (i = 0; i < n_sources; i++)
-		if (sources[i].fd == fd)
-			break;
-
-	if (i == n_sources)
+	if (fd < 0 || fd >= max_slots || slots[fd] == 0)
 		return;
+	i = slots[fd] - 1;
+	slots[fd] = 0;
 
-	if (i+1 < n_sources)
-		memmove(&sources[i], &sources[i+1], (n_sources - i) *
+#ifdef HAVE_EPOLL
+	/* Fails harmlessly if the fd was closed already. */
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+
+	if (i+1 < n_sources) {
+		memmove(&sources[i], &sources[i+1], (n_sources - i - 1) *
 		    sizeof(struct event_source));
+#ifndef HAVE_EPOLL
+		memmove(&pfds[i], &pfds[i+1], (n_sources - i - 1) *
+		    sizeof(struct pollfd));
+#endif
+	}
 	n_sources--;
+	for (; i < n_sources; i++)
+		slots[sources[i].fd] = i + 1;
+
 	if (n_sources == 0) {
 		if (max_sources > 0) {
 			free(sources);
@@ -118,60 +376,423 @@ remove_event_source(int fd)
 	}
 }
 
+/*
+ * Dispatches the X connection, i.e. the high priority source, and then
+ * input and render tasks, either once or while events are queued.
+ */
 void
 event_dispatch_xevents(int queued)
 {
 	size_t i;
 
+	for (i = 0; i < n_sources; i++)
+		if (sources[i].priority == EVENT_PRIORITY_HIGH)
+			break;
+	if (i == n_sources)
+		return;
+
 	while (!queued || have_xevents()) {
-		i = 0;
 		sources[i].handler(sources[i].fd, sources[i].udata);
-
-		for (i = 0; i < n_idles; i++)
-			idles[i].handler(idles[i].udata);
+		run_tasks(TASK_PRIORITY_RENDER);
 
 		if (!queued)
 			break;
-	}	
+	}
 }
 
+/*
+ * Waits until some sources are readable and records them to 'ready',
+ * returning their number.
+ */
+static size_t
+wait_sources(void)
+{
+	size_t i;
+	int nready;
+#ifndef HAVE_EPOLL
+	size_t n;
+#endif
+
+	if (max_ready < n_sources || max_ready == 0) {
+		max_ready = MAX(n_sources, 1);
+		if ((ready = realloc(ready, max_ready * sizeof(*ready))) ==
+		    NULL)
+			err(1, "realloc");
+	}
+
+#ifdef HAVE_EPOLL
+	if (max_epevents < max_ready) {
+		max_epevents = max_ready;
+		if ((epevents = realloc(epevents, max_epevents *
+		    sizeof(*epevents))) == NULL)
+			err(1, "realloc");
+	}
+
+	nready = epoll_wait(epfd, epevents, max_epevents, timer_timeout());
+	if (nready == -1) {
+		if (errno == EINTR)
+			return 0;
+		err(1, "epoll_wait");
+	}
+
+	for (i = 0; i < nready; i++) {
+		ready[i].fd = (uint32_t) epevents[i].data.u64;
+		ready[i].gen = epevents[i].data.u64 >> 32;
+	}
+	return nready;
+#else
+	nready = poll(pfds, n_sources, timer_timeout());
+	if (nready == -1) {
+		if (errno == EINTR)
+			return 0;
+		err(1, "poll");
+	}
+
+	for (i = 0, n = 0; i < n_sources && n < nready; i++)
+		if (pfds[i].revents != 0) {
+			ready[n].fd = sources[i].fd;
+			ready[n].gen = sources[i].gen;
+			n++;
+		}
+	return n;
+#endif
+}
+
+/*
+ * Sources with EVENT_PRIORITY_HIGH, i.e. the X connection, are served
+ * before and in between all other sources.
+ */
 void
-run_event_loop()
+event_set_priority(int fd, int priority)
+{
+	if (fd >= 0 && fd < max_slots && slots[fd] != 0)
+		sources[slots[fd] - 1].priority = priority;
+}
+
+/*
+ * Disabled sources stay added but are not waited for, so that whoever
+ * writes to the other end is left to block once the kernel buffer is
+ * full.
+ */
+void
+event_set_enabled(int fd, int enabled)
+{
+	struct event_source *source;
+#ifdef HAVE_EPOLL
+	struct epoll_event ev;
+#endif
+
+	if (fd < 0 || fd >= max_slots || slots[fd] == 0)
+		return;
+	source = &sources[slots[fd] - 1];
+	enabled = enabled != 0;
+	if (source->enabled == enabled)
+		return;
+	source->enabled = enabled;
+
+#ifdef HAVE_EPOLL
+	/*
+	 * Hangups are reported even without EPOLLIN, so the fd is taken
+	 * out of the set altogether.
+	 */
+	if (!enabled) {
+		epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+		return;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = (uint64_t) source->gen << 32 | (uint32_t) fd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+		err(1, "epoll_ctl");
+#else
+	/* poll(2) ignores negative fds. */
+	pfds[slots[fd] - 1].fd = enabled ? fd : -1;
+#endif
+}
+
+/*
+ * Handlers that read in chunks report what they consumed, and whether
+ * there is likely more to read, i.e. whether their buffer got full.
+ * They are then called again until the budget runs out.
+ */
+void
+event_consumed(size_t bytes, int more_data)
+{
+	consumed = bytes;
+	more = more_data;
+}
+
+static struct event_source *
+find_source(int fd, unsigned int gen)
+{
+	struct event_source *source;
+
+	if (fd < 0 || fd >= max_slots || slots[fd] == 0)
+		return NULL;
+	source = &sources[slots[fd] - 1];
+	if (source->gen != gen)
+		return NULL;
+	return source;
+}
+
+static int
+compare_served(const void *a, const void *b)
+{
+	const struct ready *ra = a, *rb = b;
+	struct event_source *sa, *sb;
+
+	sa = find_source(ra->fd, ra->gen);
+	sb = find_source(rb->fd, rb->gen);
+	if (sa == NULL || sb == NULL)
+		return (sa == NULL) - (sb == NULL);
+	if (sa->served != sb->served)
+		return sa->served < sb->served ? -1 : 1;
+	return 0;
+}
+
+static long
+elapsed_ms(const struct timespec *since)
 {
-	fd_set rfds;
-	size_t nready, i, maxfd;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000 +
+	    (now.tv_nsec - since->tv_nsec) / 1000000;
+}
 
-	for (i = 0; i < n_idles; i++)
-		idles[i].handler(idles[i].udata);
+/*
+ * Calls the handler while it has more to read and budget left. Reads
+ * may block, so the handler is called again only when it reports that
+ * its buffer got full and the fd is still readable.
+ */
+static void
+dispatch_budgeted(struct ready *r)
+{
+	struct event_source *source;
+	struct timespec start;
+	struct pollfd pfd;
+	size_t bytes;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	bytes = 0;
+	while ((source = find_source(r->fd, r->gen)) != NULL &&
+	    source->enabled) {
+		source->served = rounds;
+		consumed = 0;
+		more = 0;
+		source->handler(source->fd, source->udata);
+		bytes += consumed;
+		if (!more || bytes >= EVENT_BYTE_BUDGET ||
+		    elapsed_ms(&start) >= EVENT_SOURCE_MS)
+			break;
+		pfd = (struct pollfd) { r->fd, POLLIN, 0 };
+		if (poll(&pfd, 1, 0) != 1)
+			break;
+	}
+}
 
-	FD_ZERO(&rfds);
+/*
+ * Serves high priority sources that are readable right now.
+ */
+static void
+dispatch_high(void)
+{
+	struct pollfd pfd;
+	size_t i;
 
-	maxfd = 0;
 	for (i = 0; i < n_sources; i++) {
-		FD_SET(sources[i].fd, &rfds);
-		maxfd = MAX(sources[i].fd, maxfd);
+		if (sources[i].priority != EVENT_PRIORITY_HIGH ||
+		    !sources[i].enabled)
+			continue;
+		pfd = (struct pollfd) { sources[i].fd, POLLIN, 0 };
+		if (poll(&pfd, 1, 0) == 1)
+			sources[i].handler(sources[i].fd, sources[i].udata);
+	}
+}
+
+/*
+ * Dispatches high priority sources first, then the others starting
+ * from those served longest ago, each within its own budget. Handlers
+ * may add and remove sources, so each ready source is looked up again
+ * just before calling its handler.
+ */
+static void
+dispatch_ready(size_t nready)
+{
+	struct event_source *source;
+	struct timespec start;
+	size_t i, n;
+
+	rounds++;
+	for (i = 0, n = 0; i < nready; i++) {
+		if ((source = find_source(ready[i].fd, ready[i].gen)) == NULL ||
+		    !source->enabled)
+			continue;
+		if (source->priority == EVENT_PRIORITY_HIGH)
+			source->handler(source->fd, source->udata);
+		else
+			ready[n++] = ready[i];
+	}
+
+	qsort(ready, n, sizeof(*ready), compare_served);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n; i++) {
+		if (i > 0) {
+			if (elapsed_ms(&start) >= EVENT_ITERATION_MS)
+				break;
+			dispatch_high();
+		}
+		dispatch_budgeted(&ready[i]);
 	}
+}
+
+void
+run_event_loop()
+{
+	run_tasks(TASK_PRIORITY_BACKGROUND);
 
 	/*
 	 * Sometimes we will have X11 events already in the queue even
 	 * though the queue should be empty before reading more, possibly
 	 * caused by Syncs or Flushes elsewhere. So, if we have any,
-	 * we need to proceed them before select().
+	 * we need to proceed them before waiting.
 	 */
 	event_dispatch_xevents(1);
 
-	nready = select(maxfd + 1, &rfds, NULL, NULL, NULL);
-	if (nready == -1 || nready == 0)
-		err(1, "select");
+	dispatch_ready(wait_sources());
+	run_timers();
+}
 
-	while (nready) {
-		for (i = 0; i < n_sources; i++)
-			if (FD_ISSET(sources[i].fd, &rfds)) {
-				sources[i].handler(sources[i].fd,
-				    sources[i].udata);
-				nready--;
-				break;
-			}
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+timer_swap(size_t a, size_t b)
+{
+	struct timer tmp;
+
+	tmp = timers[a];
+	timers[a] = timers[b];
+	timers[b] = tmp;
+}
+
+static void
+timer_up(size_t i)
+{
+	while (i > 0 && timers[(i - 1) / 2].deadline > timers[i].deadline) {
+		timer_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void
+timer_down(size_t i)
+{
+	size_t min, child;
+
+	for (;;) {
+		min = i;
+		child = 2 * i + 1;
+		if (child < n_timers &&
+		    timers[child].deadline < timers[min].deadline)
+			min = child;
+		if (child + 1 < n_timers &&
+		    timers[child + 1].deadline < timers[min].deadline)
+			min = child + 1;
+		if (min == i)
+			break;
+		timer_swap(i, min);
+		i = min;
+	}
+}
+
+static void
+timer_remove_at(size_t i)
+{
+	timers[i] = timers[--n_timers];
+	if (i < n_timers) {
+		timer_up(i);
+		timer_down(i);
+	}
+}
+
+/*
+ * Calls 'handler' once after 'ms' milliseconds. Returns an id for
+ * cancel_timer(), or -1 on error.
+ */
+int
+add_timer(long ms, TimerHandler handler, void *udata)
+{
+	if (max_timers == n_timers)
+		if (grow_array((void **) &timers, sizeof(*timers),
+		    &max_timers) == -1)
+			return -1;
+
+	if (++timer_id <= 0)
+		timer_id = 1;
+
+	timers[n_timers] = (struct timer) { now_ns() +
+	    (uint64_t) MAX(ms, 0) * 1000000, timer_id, handler, udata };
+	timer_up(n_timers++);
+	return timer_id;
+}
+
+void
+cancel_timer(int id)
+{
+	size_t i;
+
+	for (i = 0; i < n_timers; i++)
+		if (timers[i].id == id) {
+			timer_remove_at(i);
+			return;
+		}
+}
+
+/*
+ * Milliseconds until the next timer is due, rounded up so that we
+ * never wake up early and spin, or -1 to wait indefinitely.
+ */
+static int
+timer_timeout(void)
+{
+	uint64_t now, ms;
+
+	/* Do not block while tasks have work left. */
+	if (tasks_pending)
+		return 0;
+	if (n_timers == 0)
+		return -1;
+
+	now = now_ns();
+	if (timers[0].deadline <= now)
+		return 0;
+	ms = (timers[0].deadline - now + 999999) / 1000000;
+	return ms > INT_MAX ? INT_MAX : ms;
+}
+
+/*
+ * Timers may add and cancel timers, so the heap is checked again for
+ * each.
+ */
+static void
+run_timers(void)
+{
+	struct timer timer;
+	uint64_t now;
+
+	now = now_ns();
+	while (n_timers > 0 && timers[0].deadline <= now) {
+		timer = timers[0];
+		timer_remove_at(0);
+		timer.handler(timer.udata);
 	}
 }
 
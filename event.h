@@ -18,15 +18,39 @@
 #ifndef EVENT_H
 #define EVENT_H
 
+#include <stddef.h>
+
 typedef void (*EventHandler)(int, void *);
 typedef void (*IdleHandler)(void *);
+typedef void (*TimerHandler)(void *);
+typedef int (*TaskHandler)(void *);
+
+#define EVENT_PRIORITY_NORMAL	0
+#define EVENT_PRIORITY_HIGH	1
+
+#define TASK_PRIORITY_INPUT		0
+#define TASK_PRIORITY_RENDER		1
+#define TASK_PRIORITY_BACKGROUND	2
+
+#define TASK_DONE	0
+#define TASK_MORE	1
 
 int	 add_event_source(int, EventHandler, void *);
 int	 add_idle_handler(IdleHandler, void *);
 void	 remove_event_source(int);
+void	 event_set_priority(int, int);
+void	 event_set_enabled(int, int);
+void	 event_consumed(size_t, int);
 void	 remove_idle_handler(IdleHandler, void *);
 void	 run_event_loop(void);
 
+int	 add_timer(long, TimerHandler, void *);
+void	 cancel_timer(int);
+
+int	 add_task(int, TaskHandler, void *);
+void	 cancel_task(int);
+int	 task_should_yield(void);
+
 void	 event_dispatch_xevents(int);
 
 #endif
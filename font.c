@@ -20,58 +20,44 @@
 #include "font.h"
 #include "color.h"
 #include "dpy.h"
+#include "shmrender.h"
 
 #include <X11/Xft/Xft.h>
 
-#include <limits.h>
 #include <assert.h>
 #include <err.h>
 
 #include "fontnames.c"
 
-static XftColor	 fgcolor;
-static XftColor	 bgcolor;
+static XftColor	*fgcolor;
+static XftColor	*bgcolor;
 static XftFont	*ftfont[NUM_FONT];
 static XftFont	*current_font;
 static int	 space_width;
-static XftDraw	*ftdraw;
+static XftDraw	*image_target;
 
 extern struct dpy *dpy;
 
 static XftFont	*font_load(int);
-static void	 font_set_color(XftColor *, int);
-static int	 _font_draw(Window, int, int, const char *, size_t);
+static int	 _font_draw(XftDraw *, int, int, const char *, size_t);
 
 #define TABWIDTH 8
 
-static void
-font_set_color(XftColor *ftcolor, int color)
-{
-	XColor xcolor;
-
-	xcolor = query_color(dpy, color);
-
-	ftcolor->pixel = xcolor.pixel;
-	ftcolor->color.red = xcolor.red;
-	ftcolor->color.green = xcolor.green;
-	ftcolor->color.blue = xcolor.blue;
-	ftcolor->color.alpha = USHRT_MAX;
-}
-
 /*
  * Sets font color by reusing named/enum-defined colors from color.c so
- * that we can use same color defines in font and non-font stuff.
+ * that we can use same color defines in font and non-font stuff. The
+ * colors are preallocated, so this is cheap.
  */
 void
 font_set_fgcolor(int color)
 {
-	font_set_color(&fgcolor, color);
+	fgcolor = color_xft(color);
 }
 
 void
 font_set_bgcolor(int color)
 {
-	font_set_color(&bgcolor, color);
+	bgcolor = color_xft(color);
 }
 
 int
@@ -152,49 +138,41 @@ font_str_width(int x, const char *text, size_t len)
 }
 
 void
-font_clear(Window window, int x, int y, int width)
+font_clear(XftDraw *ftdraw, int x, int y, int width)
 {
-	if (ftdraw == NULL)
-		if ((ftdraw = XftDrawCreate(DPY(dpy), window,
-		    DefaultVisual(DPY(dpy), DPY_SCREEN(dpy)),
-		    DefaultColormap(DPY(dpy), DPY_SCREEN(dpy)))) ==
-		    NULL)
-			errx(1, "XftDrawCreate failed");
-
-	if (XftDrawDrawable(ftdraw) != window)
-		XftDrawChange(ftdraw, window);
-
-	XftDrawRect(ftdraw, &bgcolor, x, y, width, current_font->height);
+#ifdef USE_SHM_RENDER
+	if (ftdraw == image_target && image_target != NULL) {
+		shmrender_rect(bgcolor, x, y, width, current_font->height);
+		return;
+	}
+#endif
+	XftDrawRect(ftdraw, bgcolor, x, y, width, current_font->height);
 }
 
 static int
-_font_draw(Window window, int x, int y, const char *text, size_t len)
+_font_draw(XftDraw *ftdraw, int x, int y, const char *text, size_t len)
 {
 	XGlyphInfo extents;
 
-	if (ftdraw == NULL)
-		if ((ftdraw = XftDrawCreate(DPY(dpy), window,
-		    DefaultVisual(DPY(dpy), DPY_SCREEN(dpy)),
-		    DefaultColormap(DPY(dpy), DPY_SCREEN(dpy)))) ==
-		    NULL)
-			errx(1, "XftDrawCreate failed");
-
-	if (XftDrawDrawable(ftdraw) != window)
-		XftDrawChange(ftdraw, window);
-
+#ifdef USE_SHM_RENDER
+	if (ftdraw == image_target && image_target != NULL)
+		return shmrender_text(current_font, fgcolor, bgcolor, x, y,
+		    text, len);
+#endif
 	font_extents(text, len, &extents);
 
-	XftDrawRect(ftdraw, &bgcolor, x, y, extents.xOff,
+	XftDrawRect(ftdraw, bgcolor, x, y, extents.xOff,
 	    current_font->height);
 
-	XftDrawStringUtf8(ftdraw, &fgcolor, current_font, x,
+	XftDrawStringUtf8(ftdraw, fgcolor, current_font, x,
 	    y + current_font->ascent, (const FcChar8 *) text, len);
 
 	return extents.xOff;
 }
 
 int
-font_draw(Window window, int x, int sx, int y, const char *text, size_t len)
+font_draw(XftDraw *ftdraw, int x, int sx, int y, const char *text,
+    size_t len)
 {
 	size_t i, j;
 	int x_out, tabstop, tabwidth, remaining;
@@ -204,7 +182,7 @@ font_draw(Window window, int x, int sx, int y, const char *text, size_t len)
 	for (i = 0; i < len; i++) {
 		if (text[i] == '\t') {
 			if (j!=i)
-				x_out += _font_draw(window, sx+x_out, y,
+				x_out += _font_draw(ftdraw, sx+x_out, y,
 				    &text[j], i-j);
 
 			j=i+1;
@@ -213,12 +191,12 @@ font_draw(Window window, int x, int sx, int y, const char *text, size_t len)
 			tabstop = ((x+x_out) / tabwidth);
 			remaining = tabwidth - ((x+x_out) -
 			    (tabstop * tabwidth));
-			font_clear(window, sx+x_out, y, remaining);
+			font_clear(ftdraw, sx+x_out, y, remaining);
 			x_out += remaining;
 		}
 	}
 	if (j < len)
-		x_out += _font_draw(window, sx+x_out, y, &text[j], i-j);
+		x_out += _font_draw(ftdraw, sx+x_out, y, &text[j], i-j);
 	return x_out;
 }
 
@@ -246,16 +224,58 @@ font_load(int id)
 }
 
 /*
- * TODO: Actually have separate ftdraw for each widget.
- * XftDrawChange() is nice, but causes problems.
+ * Each drawable has its own XftDraw so that Xft can keep its per-drawable
+ * Picture and clip state instead of having them reset by XftDrawChange().
  */
+XftDraw *
+font_create_ftdraw(Drawable drawable)
+{
+	XftDraw *ftdraw;
+
+	if ((ftdraw = XftDrawCreate(DPY(dpy), drawable,
+	    DefaultVisual(DPY(dpy), DPY_SCREEN(dpy)),
+	    DefaultColormap(DPY(dpy), DPY_SCREEN(dpy)))) == NULL)
+		errx(1, "XftDrawCreate failed");
+
+	return ftdraw;
+}
+
 void
-font_destroy_ftdraw()
+font_free_ftdraw(XftDraw *ftdraw)
 {
-	if (ftdraw != NULL) {
-		XftDrawDestroy(ftdraw);
-		ftdraw = NULL;
-	}
+	XftDrawDestroy(ftdraw);
+}
+
+/*
+ * Limits drawing to the given area until font_clear_clip() is called.
+ */
+void
+font_set_clip(XftDraw *ftdraw, int x, int y, int width, int height)
+{
+	XRectangle r;
+
+	r.x = x;
+	r.y = y;
+	r.width = width;
+	r.height = height;
+	if (XftDrawSetClipRectangles(ftdraw, 0, 0, &r, 1) == False)
+		errx(1, "XftDrawSetClipRectangles failed");
+}
+
+void
+font_clear_clip(XftDraw *ftdraw)
+{
+	XftDrawSetClip(ftdraw, NULL);
+}
+
+/*
+ * Redirects drawing to 'ftdraw' into the client side image of
+ * shmrender.c until called again with NULL.
+ */
+void
+font_set_image_target(XftDraw *ftdraw)
+{
+	image_target = ftdraw;
 }
 
 void
@@ -269,6 +289,4 @@ font_close()
 			ftfont[i] = NULL;
 		}
 	}
-
-	font_destroy_ftdraw();
 }
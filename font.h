@@ -22,11 +22,12 @@
 
 #include <X11/Xlib.h>
 #include <X11/extensions/Xrender.h>
+#include <X11/Xft/Xft.h>
 
 struct dpy;
 
-int	 font_draw(Window, int, int, int, const char *, size_t);
-void	 font_clear(Window, int, int, int);
+int	 font_draw(XftDraw *, int, int, int, const char *, size_t);
+void	 font_clear(XftDraw *, int, int, int);
 void	 font_extents(const char *, size_t, XGlyphInfo *);
 int	 font_str_width(int, const char *, size_t);
 void	 font_set(int);
@@ -35,6 +36,10 @@ int	 font_width(void);
 void	 font_set_fgcolor(int);
 void	 font_set_bgcolor(int);
 void	 font_close(void);
-void	 font_destroy_ftdraw(void);
+XftDraw	*font_create_ftdraw(Drawable);
+void	 font_free_ftdraw(XftDraw *);
+void	 font_set_clip(XftDraw *, int, int, int, int);
+void	 font_clear_clip(XftDraw *);
+void	 font_set_image_target(XftDraw *);
 
 #endif
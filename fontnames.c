@@ -0,0 +1,5 @@
+/* Generated on Sun Oct 18 09:15:38 UTC 2026 using 'mkenum' */
+static const char *fontname[] = {
+	"DejaVu Sans Mono:size=16.0",
+	"-misc-fixed-medium-r-normal--20-200-75-75-c-100-iso10646-1",
+};
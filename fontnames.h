@@ -0,0 +1,9 @@
+/* Generated on Sun Oct 18 09:15:38 UTC 2026 using 'mkenum' */
+#ifndef FONT_NAMES_H
+#define FONT_NAMES_H
+enum font {
+	FONT_NORMAL,
+	FONT_FALLBACK,
+	NUM_FONT
+};
+#endif
@@ -78,9 +78,7 @@ label_set(struct label *label, const char *text)
 	WIDGET_PREFER_HEIGHT(label) = font_height();
 	widget_update_geometry(WIDGET(label));
 
-	WIDGET(label)->need_expose = 1;
-	WIDGET(label)->expose_from_px = 0;
-	WIDGET(label)->expose_to_px = WIDGET_HEIGHT(label);
+	widget_damage(WIDGET(label), 0, WIDGET_HEIGHT(label));
 }
 
 void
@@ -97,13 +95,14 @@ static void
 label_draw(int x, int y, int width, int height, void *udata)
 {
 	struct label *label = udata;
+	XftDraw *ftdraw;
 
 	if (label->text == NULL)
 		return;
 
 	font_set_fgcolor(COLOR_FLAGS);
 	font_set_bgcolor(COLOR_TITLE_BG_NORMAL);
-	x = font_draw(WINDOW(label), 0, 0, 0, label->text,
-	    strlen(label->text));
-	font_clear(WINDOW(label), x, 0, WIDGET_WIDTH(label) - x);
+	ftdraw = widget_ftdraw(WIDGET(label));
+	x = font_draw(ftdraw, 0, 0, 0, label->text, strlen(label->text));
+	font_clear(ftdraw, x, 0, WIDGET_WIDTH(label) - x);
 }
@@ -20,7 +20,11 @@
 #include "event.h"
 #include "xevent.h"
 #include "font.h"
+#include "color.h"
 #include "pty.h"
+#include "child.h"
+#include "rowcache.h"
+#include "shmrender.h"
 
 #include <err.h>
 #include <stdlib.h>
@@ -52,6 +56,8 @@ main(int argc, char *argv[])
 	if ((dpy = dpy_create()) == NULL)
 		errx(1, "failed connecting to X11 server");
 
+	color_init(dpy);
+
 	if (!setlocale(LC_CTYPE, "en_US.UTF-8") || !XSupportsLocale())
 		errx(1, "no locale support");
 	else
@@ -75,6 +81,8 @@ main(int argc, char *argv[])
 	} while (e.type != MapNotify);
 
 	add_event_source(ConnectionNumber(DPY(dpy)), process_xevents, NULL);
+	event_set_priority(ConnectionNumber(DPY(dpy)), EVENT_PRIORITY_HIGH);
+	child_init();
 
 	s = NULL;
 	for (i = 1; i < argc; i++) {
@@ -113,6 +121,10 @@ main(int argc, char *argv[])
 		run_event_loop();
 
 	XSync(DPY(dpy), False);
+	rowcache_flush();
+#ifdef USE_SHM_RENDER
+	shmrender_close();
+#endif
 	font_close();
 
 	XSync(DPY(dpy), False);
@@ -26,12 +26,11 @@
 #include "label.h"
 #include "uflags.h"
 #include "button.h"
-
-#ifdef HAVE_PTY_H
-#include <pty.h>
-#else
-#include <util.h>
-#endif
+#include "child.h"
+#include "spawn.h"
+#include "reader.h"
+#include "util.h"
+#include "config.h"
 
 #include <sys/wait.h>
 #include <sys/stat.h>
@@ -43,6 +42,7 @@
 #include <limits.h>
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
 
 struct editor;
 
@@ -52,12 +52,32 @@ static void	pty_recreate_ts_buffer(struct pty *);
 static void	pty_submit_command(const char *, void *);
 static void	pty_submit_stdin(const char *, void *);
 static void	pty_process_events(int, void *);
+static void	pty_output(struct pty *, const char *, size_t,
+		    const size_t *, size_t);
+static void	pty_close_fd(struct pty *);
+static void	pty_ingested(struct pty *, size_t, size_t);
+#ifdef WANT_READER_THREADS
+static void	pty_reader_output(const char *, size_t, const size_t *,
+		    size_t, void *);
+#endif
+static void	pty_write(struct pty *, const char *, size_t);
+static ssize_t	pty_write_some(int, const char *, size_t);
+static void	pty_flush_input(void *);
+static void	pty_child_exit(pid_t, int, struct rusage *, void *);
+static void	pty_update_status(struct pty *);
+static void	pty_throttle(struct pty *, struct pty *);
+static void	pty_set_paused(struct pty *, PtyPause);
+static void	pty_resume_check(void *);
+static void	pty_ts_tail(void *);
 
 static int	pty_add_slave(struct pty *, struct pty *);
 static int	pty_find_slave(struct pty *, struct pty *);
 static void	pty_remove_slave(struct pty *, struct pty *);
 
 static void	pty_file_updated(int, int, int, int, BufferUpdate, void *);
+static int	pty_load_file(void *);
+static void	pty_load_done(struct pty *);
+static void	pty_cancel_load(struct pty *);
 static void	pty_exec_handler(const char *, int, int, void *);
 
 static void	pty_action(struct pty *, PtyAction, const char *, int, int);
@@ -181,52 +201,308 @@ pty_show_output(struct pty *pty)
 static void
 pty_process_events(int ptyfd, void *udata)
 {
-	int n;
-	static char buf[8192];
-	struct pty *master = udata, *pty;
-	int status;
-	int state;
+	ssize_t n;
+	static char buf[PTY_READ_SIZE];
+	struct pty *master = udata;
 
+	/*
+	 * The fd is non-blocking, and the event loop calls again while
+	 * there is output left and the budget allows. A pty may return
+	 * less than asked even when more is pending, so every read counts
+	 * as possibly having more.
+	 */
 	n = read(ptyfd, buf, sizeof(buf));
+	if (n == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n > 0)
+		event_consumed(n, 1);
+
+	pty_output(master, buf, n > 0 ? n : 0, NULL, 0);
+}
+
+/*
+ * Inserts output of the command to the active buffer, or finishes up
+ * at end of file when 'len' is 0. 'ends' has offsets of line breaks if
+ * they are known already.
+ */
+static void
+pty_output(struct pty *master, const char *s, size_t len,
+    const size_t *ends, size_t nends)
+{
+	struct pty *pty;
+	size_t rows;
 
-	if (n > 0 && master->active_slave != NULL)
+	if (len > 0 && master->active_slave != NULL)
 		pty = master->active_slave;
 	else
 		pty = master;
 
-	if (n <= 0 && master->n_slaves > 0)
+	if (len == 0 && master->n_slaves > 0)
 		while (master->n_slaves)
 			pty_remove_slave(master,
 			    master->slaves[master->n_slaves-1]);
 
-	if (n > 0) {
-		buffer_insert(pty->ts_ocursor, buf, n);
-		statbar_update_status(pty->statbar, STATBAR_STATE_STARTED,
-		    pty->pid, 0, buffer_rows(pty->ts_buffer));
-	} else {
-		remove_event_source(ptyfd);
-		close(ptyfd);
-		pty->ptyfd = -1;
+	if (len > 0) {
+		rows = buffer_rows(pty->ts_buffer);
+		buffer_insert_lines(pty->ts_ocursor, s, len, ends, nends);
+		pty_ingested(pty, len, buffer_rows(pty->ts_buffer) - rows);
+		pty_update_status(pty);
+		pty_throttle(master, pty);
+	} else
+		pty_close_fd(pty);
+}
 
-		status = 0;
-		state = STATBAR_STATE_STARTED;
-		if (waitpid(pty->pid, &status, 0) == pty->pid) {
-			pty->pid = 0;
-
-			if (WIFSIGNALED(status)) {
-				state = STATBAR_STATE_SIGNALED;
-				status = WTERMSIG(status);
-			} else if (WIFEXITED(status)) {
-				state = STATBAR_STATE_EXITED;
-				status = WEXITSTATUS(status);
-			}
+static void
+pty_ingested(struct pty *pty, size_t bytes, size_t lines)
+{
+	pty->bytes_in += bytes;
+	pty->lines_in += lines;
+	statbar_update_metrics(pty->statbar, pty->bytes_in, pty->lines_in,
+	    buffer_memory(pty->ts_buffer));
+}
+
+#ifdef WANT_READER_THREADS
+static void
+pty_reader_output(const char *s, size_t len, const size_t *ends,
+    size_t nends, void *udata)
+{
+	pty_output(udata, s, len, ends, nends);
+}
+#endif
+
+static void
+pty_close_fd(struct pty *pty)
+{
+	if (pty->ptyfd == -1)
+		return;
+
+	pty_set_paused(pty, PTY_PAUSE_NONE);
+	if (pty->input_timer != 0) {
+		cancel_timer(pty->input_timer);
+		pty->input_timer = 0;
+	}
+	pty->input_used = 0;
+#ifdef WANT_READER_THREADS
+	if (pty->reader != NULL) {
+		reader_free(pty->reader);
+		pty->reader = NULL;
+	}
+#endif
+	remove_event_source(pty->ptyfd);
+	close(pty->ptyfd);
+	pty->ptyfd = -1;
 
-			editor_shrink(pty->ts_editor);
+	/* Metrics are only shown while a command is producing output. */
+	statbar_update_metrics(pty->statbar, 0, 0, 0);
+}
+
+/*
+ * Stops reading the output of the command of 'master' when 'pty', the
+ * one showing it, holds too much of it or is scrolled too far behind.
+ * The command then blocks once the kernel buffer of the pty is full.
+ */
+static void
+pty_throttle(struct pty *master, struct pty *pty)
+{
+	if (master->paused != PTY_PAUSE_NONE || master->ptyfd == -1)
+		return;
+
+	if (buffer_memory(pty->ts_buffer) >= pty->memory_limit)
+		pty_set_paused(master, PTY_PAUSE_MEMORY);
+	else if (editor_rows_behind(pty->ts_editor) >= PTY_PAUSE_ROWS)
+		pty_set_paused(master, PTY_PAUSE_LAG);
+}
+
+static void
+pty_set_paused(struct pty *master, PtyPause paused)
+{
+	size_t i;
+
+	if (master->paused == paused)
+		return;
+	master->paused = paused;
+
+#ifdef WANT_READER_THREADS
+	if (master->reader != NULL)
+		reader_pause(master->reader, paused != PTY_PAUSE_NONE);
+	else
+		event_set_enabled(master->ptyfd, paused == PTY_PAUSE_NONE);
+#else
+	event_set_enabled(master->ptyfd, paused == PTY_PAUSE_NONE);
+#endif
+
+	if (master->resume_timer != 0) {
+		cancel_timer(master->resume_timer);
+		master->resume_timer = 0;
+	}
+	if (paused == PTY_PAUSE_LAG && (master->resume_timer =
+	    add_timer(PTY_RESUME_MS, pty_resume_check, master)) == -1)
+		err(1, "add_timer");
+
+	statbar_set_paused(master->statbar, paused != PTY_PAUSE_NONE);
+	for (i = 0; i < master->n_slaves; i++)
+		statbar_set_paused(master->slaves[i]->statbar,
+		    paused != PTY_PAUSE_NONE);
+}
+
+/*
+ * Continues once the view paused behind the output has been scrolled
+ * back to the end.
+ */
+static void
+pty_resume_check(void *udata)
+{
+	struct pty *master = udata, *pty;
+
+	master->resume_timer = 0;
+	pty = master->active_slave != NULL ? master->active_slave : master;
+	if (editor_rows_behind(pty->ts_editor) == 0)
+		pty_set_paused(master, PTY_PAUSE_NONE);
+	else if ((master->resume_timer = add_timer(PTY_RESUME_MS,
+	    pty_resume_check, master)) == -1)
+		err(1, "add_timer");
+}
+
+/*
+ * Pressing End in the output continues, allowing twice the memory if
+ * that was the limit.
+ */
+static void
+pty_ts_tail(void *udata)
+{
+	struct pty *pty = udata, *master;
+
+	master = pty->master != NULL ? pty->master : pty;
+	if (master->paused == PTY_PAUSE_NONE)
+		return;
+
+	while (buffer_memory(pty->ts_buffer) >= pty->memory_limit)
+		pty->memory_limit *= 2;
+	pty_set_paused(master, PTY_PAUSE_NONE);
+}
+
+/*
+ * Records how the command ended. Its output may still be coming.
+ */
+static void
+pty_child_exit(pid_t pid, int status, struct rusage *rusage, void *udata)
+{
+	struct pty *pty = udata;
+
+	pty->pid = 0;
+	pty->exited = 1;
+	pty->wstatus = status;
+	pty->rusage = *rusage;
+
+	editor_shrink(pty->ts_editor);
+	pty_update_status(pty);
+}
+
+static void
+pty_update_status(struct pty *pty)
+{
+	int state, status;
+
+	state = STATBAR_STATE_STARTED;
+	status = 0;
+	if (pty->pid == 0 && pty->exited) {
+		if (WIFSIGNALED(pty->wstatus)) {
+			state = STATBAR_STATE_SIGNALED;
+			status = WTERMSIG(pty->wstatus);
+		} else if (WIFEXITED(pty->wstatus)) {
+			state = STATBAR_STATE_EXITED;
+			status = WEXITSTATUS(pty->wstatus);
 		}
+	}
+
+	statbar_update_status(pty->statbar, state, pty->pid, status,
+	    buffer_rows(pty->ts_buffer));
+}
 
-		statbar_update_status(pty->statbar, state, pty->pid,
-		    status, buffer_rows(pty->ts_buffer));
+/*
+ * Writes what fits of 's' to the non-blocking pty and returns how much
+ * that was, or -1 on error.
+ */
+static ssize_t
+pty_write_some(int fd, const char *s, size_t len)
+{
+	size_t done;
+	ssize_t n;
+
+	done = 0;
+	while (done < len) {
+		if ((n = write(fd, &s[done], len - done)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			warn("write");
+			return -1;
+		}
+		done += n;
 	}
+	return done;
+}
+
+/*
+ * Writes 's' to the pty of 'pty', queueing what does not fit while the
+ * command is not reading its input. The queue is flushed from a timer
+ * so that the event loop never waits for the command, which may itself
+ * be blocked on its output e.g. while reading is paused.
+ */
+static void
+pty_write(struct pty *pty, const char *s, size_t len)
+{
+	ssize_t n;
+	size_t sz;
+	char *tmp;
+
+	if (pty->ptyfd == -1)
+		return;
+
+	if (pty->input_used == 0) {
+		if ((n = pty_write_some(pty->ptyfd, s, len)) == -1)
+			return;
+		s += n;
+		len -= n;
+	}
+	if (len == 0)
+		return;
+
+	if (pty->input_used + len > pty->input_size) {
+		sz = MAX(pty->input_size * 2, pty->input_used + len);
+		if ((tmp = realloc(pty->input, sz)) == NULL)
+			err(1, "realloc");
+		pty->input = tmp;
+		pty->input_size = sz;
+	}
+	memcpy(&pty->input[pty->input_used], s, len);
+	pty->input_used += len;
+
+	if (pty->input_timer == 0 && (pty->input_timer =
+	    add_timer(PTY_INPUT_RETRY_MS, pty_flush_input, pty)) == -1)
+		err(1, "add_timer");
+}
+
+static void
+pty_flush_input(void *udata)
+{
+	struct pty *pty = udata;
+	ssize_t n;
+
+	pty->input_timer = 0;
+	if (pty->ptyfd == -1 ||
+	    (n = pty_write_some(pty->ptyfd, pty->input, pty->input_used))
+	    == -1) {
+		pty->input_used = 0;
+		return;
+	}
+	memmove(pty->input, &pty->input[n], pty->input_used - n);
+	pty->input_used -= n;
+
+	if (pty->input_used > 0 && (pty->input_timer =
+	    add_timer(PTY_INPUT_RETRY_MS, pty_flush_input, pty)) == -1)
+		err(1, "add_timer");
 }
 
 static void
@@ -255,8 +531,8 @@ pty_submit_stdin(const char *s, void *udata)
 			buffer_remove_row(pty->ts_buffer,
 			    pty->ts_icursor->row+1);
 	
-		write(pty->ptyfd, s, strlen(s));
-		write(pty->ptyfd, "\n", 1);
+		pty_write(pty, s, strlen(s));
+		pty_write(pty, "\n", 1);
 	} else
 		buffer_insert(pty->ts_icursor, "\n", 1);
 }
@@ -274,6 +550,51 @@ pty_file_updated(int x, int y, int w, int h, BufferUpdate type, void *udata)
 	pty->file_unsaved = 1;
 }
 
+/*
+ * Loads the file in slices, so that opening a large file does not
+ * hold up input and drawing.
+ */
+static int
+pty_load_file(void *udata)
+{
+	struct pty *pty = udata;
+	static char buf[65536];
+	size_t n;
+
+	do {
+		if ((n = fread(buf, sizeof(char), sizeof(buf), pty->fp)) == 0) {
+			if (ferror(pty->fp))
+				warn("%s", pty->file);
+			pty->load_task = 0;
+			pty_load_done(pty);
+			return TASK_DONE;
+		}
+		buffer_insert(pty->ts_ocursor, buf, n);
+	} while (!task_should_yield());
+
+	statbar_update_status(pty->statbar, STATBAR_STATE_FILE_SAVED,
+	    0, 0, buffer_rows(pty->ts_buffer));
+	return TASK_MORE;
+}
+
+static void
+pty_load_done(struct pty *pty)
+{
+	statbar_update_status(pty->statbar, STATBAR_STATE_FILE_SAVED,
+	    0, 0, buffer_rows(pty->ts_buffer));
+
+	buffer_add_listener(pty->ts_buffer, pty_file_updated, pty);
+}
+
+static void
+pty_cancel_load(struct pty *pty)
+{
+	if (pty->load_task != 0) {
+		cancel_task(pty->load_task);
+		pty->load_task = 0;
+	}
+}
+
 void
 pty_save(struct pty *pty)
 {
@@ -284,6 +605,11 @@ pty_save(struct pty *pty)
 	if (pty->ts_buffer == NULL || pty->file == NULL)
 		return;
 
+	if (pty->load_task != 0) {
+		warnx("%s: still loading", pty->file);
+		return;
+	}
+
 	if (pty->fp != NULL)
 		fclose(pty->fp);
 
@@ -301,6 +627,7 @@ pty_save(struct pty *pty)
 		fwrite("\n", 1, 1, pty->fp);
 	}
 	fclose(pty->fp);
+	pty->fp = NULL;
 
 	if (pty->file_unsaved)
 		statbar_update_status(pty->statbar, STATBAR_STATE_FILE_SAVED,
@@ -325,18 +652,26 @@ pty_run_command(struct pty *pty, const char *s)
 	pty_submit_command(s, pty);
 }
 
+/*
+ * We don't support traditional vt-control sequences.
+ */
+static char *const pty_env[] = {
+	"TERM=dumb",
+	"PS1=\\$ ",
+	"PAGER=cat",
+	NULL
+};
+
 static void
 pty_submit_command(const char *s, void *udata)
 {
-	int status;
-	char *sh;
+	char *sh, *argv[4];
 	const char *p;
 	struct pty *pty = udata, *master;
 	struct termios ts;
 	size_t len;
 	int i, send_ts, use_file, use_dir;
 	size_t n;
-	char buf[4096];
 	char *delim = "\x04";
 	struct dirent *ent;
 	char resolved[PATH_MAX + 1];
@@ -363,6 +698,7 @@ pty_submit_command(const char *s, void *udata)
 		else
 			use_file = 1;
 
+		pty_cancel_load(pty);
 		if (pty->fp != NULL)
 			fclose(pty->fp);
 		if (pty->file != NULL) {
@@ -396,19 +732,19 @@ pty_submit_command(const char *s, void *udata)
 		master->active_slave = pty;
 
 		if (!send_ts || len > 0) {
-			write(master->ptyfd, s, len);
-			write(master->ptyfd, "\n", 1);
+			pty_write(master, s, len);
+			pty_write(master, "\n", 1);
 		}
 
 		if (send_ts) {
 			for (i = 0; i < buffer_rows(pty->ts_buffer); i++) {
 				p = buffer_u8str_at(pty->ts_buffer, i, &n);
 				if (p != NULL) {
-					write(master->ptyfd, p, n);
-					write(master->ptyfd, "\n", 1);
+					pty_write(master, p, n);
+					pty_write(master, "\n", 1);
 				}
 			}
-			write(master->ptyfd, delim, strlen(delim));
+			pty_write(master, delim, strlen(delim));
 		}
 
 		if (pty->ts_buffer != NULL)
@@ -417,18 +753,23 @@ pty_submit_command(const char *s, void *udata)
 		return;
 	}
 
-	if (pty->pid > 0) {
+	/*
+	 * The previous command may have been reaped already while its
+	 * pty is still open, e.g. when output is pending or paused.
+	 */
+	if (pty->ptyfd != -1) {
 		while (pty->n_slaves)
 			pty_remove_slave(pty,
 			    pty->slaves[pty->n_slaves-1]);
 
-		remove_event_source(pty->ptyfd);
-		close(pty->ptyfd);
-		pty->ptyfd = -1;
-		kill(pty->pid, 9);
-		waitpid(pty->pid, &status, 0);
+		pty_close_fd(pty);
+	}
+	if (pty->pid > 0) {
+		child_unwatch(pty->pid);
+		kill(pty->pid, SIGKILL);
 		pty->pid = 0;
 	}
+	pty->exited = 0;
 
 	/*
 	 * Clear previous buffer.
@@ -442,15 +783,18 @@ pty_submit_command(const char *s, void *udata)
 		} else if (pty->fp == NULL) {
 			buffer_insert(pty->ts_ocursor, strerror(errno),
 			    strlen(strerror(errno)));
+		} else if ((pty->load_task = add_task(
+		    TASK_PRIORITY_BACKGROUND, pty_load_file, pty)) != -1) {
+			pty_show_output(pty);
+			return;
 		} else {
-			while ((n = fread(buf, sizeof(char), sizeof(buf),
-			    pty->fp)) > 0)
-				buffer_insert(pty->ts_ocursor, buf, n);
+			warn("add_task");
+			while (pty_load_file(pty) == TASK_MORE)
+				;
+			pty_show_output(pty);
+			return;
 		}
-		statbar_update_status(pty->statbar, STATBAR_STATE_FILE_SAVED,
-		    0, 0, buffer_rows(pty->ts_buffer));
-
-		buffer_add_listener(pty->ts_buffer, pty_file_updated, pty);
+		pty_load_done(pty);
 
 		pty_show_output(pty);
 		return;
@@ -487,7 +831,7 @@ pty_submit_command(const char *s, void *udata)
 	}
 
 	sh = getenv("SHELL");
-	if (sh == NULL || sh[0] == '\0')
+	if (sh == NULL || sh[0] != '/')
 		sh = "/bin/sh";
 
 	memset(&ts, '\0', sizeof(struct termios));
@@ -510,25 +854,34 @@ pty_submit_command(const char *s, void *udata)
 	ts.c_ispeed = B115200;
 	ts.c_ospeed = B115200;
 
-	pty->pid = forkpty(&pty->ptyfd, NULL, &ts, NULL);
-	if (pty->pid < 0)
-		err(1, "forkpty");
-
-	if (pty->pid == 0) {
-		/*
-		 * We don't support traditional vt-control sequences.
-		 */
-		setenv("TERM", "dumb", 1);
-		setenv("PS1", "\\$ ", 1);
-		setenv("PAGER", "cat", 1);
-		if (execlp(sh, sh, "-c", s, NULL) == -1)
-			err(1, "execlp");
+	argv[0] = sh;
+	argv[1] = "-c";
+	argv[2] = (char *) s;
+	argv[3] = NULL;
+	if ((pty->pid = spawn_pty(&ts, sh, argv, pty_env, &pty->ptyfd)) == -1) {
+		warn("spawn %s", sh);
+		pty->pid = 0;
+		pty->ptyfd = -1;
+		pty_show_output(pty);
+		return;
 	}
 
+	if (fcntl(pty->ptyfd, F_SETFL, fcntl(pty->ptyfd, F_GETFL) |
+	    O_NONBLOCK) == -1)
+		warn("fcntl");
+#ifdef WANT_READER_THREADS
+	if ((pty->reader = reader_create(pty->ptyfd, pty_reader_output,
+	    pty)) == NULL) {
+		warn("reader_create");
+		add_event_source(pty->ptyfd, pty_process_events, pty);
+	}
+#else
 	add_event_source(pty->ptyfd, pty_process_events, pty);
+#endif
+	if (child_watch(pty->pid, pty_child_exit, pty) == -1)
+		warn("child_watch");
 
-	statbar_update_status(pty->statbar, STATBAR_STATE_STARTED,
-	    pty->pid, status, buffer_rows(pty->ts_buffer));
+	pty_update_status(pty);
 
 	pty_show_output(pty);
 }
@@ -574,6 +927,10 @@ pty_create_ts(struct pty *pty)
 
 	pty->ts_editor->exec = pty_exec_handler;
 	pty->ts_editor->exec_udata = pty;
+	pty->ts_editor->tail = pty_ts_tail;
+	pty->ts_editor->tail_udata = pty;
+	editor_set_follow(pty->ts_editor, 1);
+	pty->memory_limit = PTY_PAUSE_MEMORY;
 
 	WIDGET(pty->ts_editor)->level = 1;
 	return 0;
@@ -641,6 +998,7 @@ pty_remove_slave(struct pty *pty, struct pty *slave)
 static void
 pty_recreate_ts_buffer(struct pty *pty)
 {
+	pty_cancel_load(pty);
 	buffer_cursor_free(pty->ts_icursor);
 	buffer_cursor_free(pty->ts_ocursor);
 	buffer_free(pty->ts_buffer);
@@ -653,6 +1011,8 @@ pty_recreate_ts_buffer(struct pty *pty)
 
 	editor_set_cursor(pty->ts_editor, pty->ts_icursor, pty->ts_ocursor);
 	pty->ts_editor->old_height = 0;	/* TODO: Make editor do this */
+	pty->bytes_in = pty->lines_in = 0;
+	pty->memory_limit = PTY_PAUSE_MEMORY;
 }
 
 void
@@ -663,6 +1023,7 @@ pty_free(struct pty *pty)
 	if (pty->slaves != NULL)
 		free(pty->slaves);
 
+	pty_cancel_load(pty);
 	if (pty->fp != NULL)
 		fclose(pty->fp);
 
@@ -672,11 +1033,11 @@ pty_free(struct pty *pty)
 	if (pty->master != NULL)
 		pty_remove_slave(pty->master, pty);
 
-	if (pty->ptyfd != -1) {
-		remove_event_source(pty->ptyfd);
-		close(pty->ptyfd);
-		pty->ptyfd = -1;
-	}
+	pty_close_fd(pty);
+	if (pty->pid > 0)
+		child_unwatch(pty->pid);
+	if (pty->input != NULL)
+		free(pty->input);
 
 	if (pty->cmd_editor != NULL)
 		editor_free(pty->cmd_editor);
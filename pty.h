@@ -21,12 +21,14 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <sys/types.h>
+#include <sys/resource.h>
 #include <dirent.h>
 
 struct dpy;
 struct editor;
 struct widget;
 struct button;
+struct reader;
 struct pty;
 
 typedef enum pty_action {
@@ -35,6 +37,12 @@ typedef enum pty_action {
 	PtyActionToggleHide
 } PtyAction;
 
+typedef enum pty_pause {
+	PTY_PAUSE_NONE,
+	PTY_PAUSE_MEMORY,
+	PTY_PAUSE_LAG
+} PtyPause;
+
 typedef void (*PtyActionCallback)(struct pty *, PtyAction, const char *,
     int x, int y, void *);
 
@@ -44,11 +52,33 @@ struct pty {
 
 	pid_t pid;
 	int ptyfd;
+	struct reader *reader;
+
+	/* Totals shown with rates in the status bar. */
+	size_t bytes_in;
+	size_t lines_in;
+
+	/* Reading stops while paused, see pty_throttle(). */
+	PtyPause paused;
+	int resume_timer;
+	size_t memory_limit;
+
+	/* Input the command has not read yet, see pty_write(). */
+	char *input;
+	size_t input_used;
+	size_t input_size;
+	int input_timer;
+
+	/* Set once the last command has been reaped. */
+	int exited;
+	int wstatus;
+	struct rusage rusage;
 
 	FILE *fp;
 	DIR *dp;
 	char *file;
 	int file_unsaved;
+	int load_task;
 
 	struct layout *hbox;
 	struct layout *vbox;
@@ -0,0 +1,483 @@
+/*
+ * vtsh - A mashup of virtual terminal and shell
+ * Copyright (c) 2022, Tommi Leino <namhas@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * reader.c: Reads an fd in a thread of its own. The thread splits the
+ * input to batches that end at a line break, or at a character
+ * boundary for very long lines, replaces malformed UTF-8 and records
+ * where the lines end. It passes the batches in a single-producer,
+ * single-consumer ring to the main thread, which is woken up through
+ * an eventfd(2) or a pipe registered as an event source. The main
+ * thread only inserts the batches.
+ */
+
+#include "reader.h"
+
+#ifdef WANT_READER_THREADS
+
+#include "event.h"
+
+#include <pthread.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+
+#ifdef HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
+#define RING_SIZE	64	/* Power of two */
+#define READ_SIZE	(64 * 1024)
+
+/*
+ * 'ends' has the offsets of line breaks in 'data'.
+ */
+struct batch {
+	char	*data;
+	size_t	 len;
+	size_t	*ends;
+	size_t	 nends;
+};
+
+/*
+ * 'head' is written by the reader thread only and 'tail' by the main
+ * thread only. A batch with NULL data marks the end of file.
+ */
+struct reader {
+	int		 fd;
+	ReaderCallback	 callback;
+	void		*udata;
+
+	struct batch	 ring[RING_SIZE];
+	size_t		 head;
+	size_t		 tail;
+	int		 waiting;
+
+	int		 wake[2];	/* To the main thread */
+	int		 space[2];	/* To the reader thread */
+	int		 stop[2];
+
+	pthread_t	 thread;
+	int		 started;
+	int		 paused;
+};
+
+static void	*reader_main(void *);
+static int	 reader_push(struct reader *, struct batch *);
+static int	 reader_pass(struct reader *, const char *, size_t);
+static int	 reader_wait(struct reader *, int);
+static size_t	 reader_split(const char *, size_t, int);
+static size_t	 reader_utf8_len(const unsigned char *, size_t);
+static size_t	 reader_validate(const char *, size_t, char *, size_t *,
+		    size_t *);
+static void	 reader_drain(int, void *);
+static int	 reader_pipe(int [2]);
+static void	 reader_notify(int);
+static void	 reader_clear(int);
+static void	 reader_close_pipe(int [2]);
+
+static int
+reader_pipe(int fds[2])
+{
+#ifdef HAVE_EVENTFD
+	if ((fds[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+		return -1;
+	fds[1] = fds[0];
+#else
+	int i;
+
+	if (pipe(fds) == -1)
+		return -1;
+	for (i = 0; i < 2; i++)
+		if (fcntl(fds[i], F_SETFL, O_NONBLOCK) == -1 ||
+		    fcntl(fds[i], F_SETFD, FD_CLOEXEC) == -1)
+			return -1;
+#endif
+	return 0;
+}
+
+static void
+reader_close_pipe(int fds[2])
+{
+	if (fds[0] != -1)
+		close(fds[0]);
+	if (fds[1] != -1 && fds[1] != fds[0])
+		close(fds[1]);
+	fds[0] = fds[1] = -1;
+}
+
+static void
+reader_notify(int fd)
+{
+#ifdef HAVE_EVENTFD
+	uint64_t one = 1;
+
+	write(fd, &one, sizeof(one));
+#else
+	write(fd, "", 1);
+#endif
+}
+
+static void
+reader_clear(int fd)
+{
+	char buf[64];
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+}
+
+struct reader *
+reader_create(int fd, ReaderCallback callback, void *udata)
+{
+	struct reader *reader;
+
+	if ((reader = calloc(1, sizeof(*reader))) == NULL)
+		return NULL;
+	reader->fd = fd;
+	reader->callback = callback;
+	reader->udata = udata;
+	reader->wake[0] = reader->wake[1] = -1;
+	reader->space[0] = reader->space[1] = -1;
+	reader->stop[0] = reader->stop[1] = -1;
+
+	if (reader_pipe(reader->wake) == -1 ||
+	    reader_pipe(reader->space) == -1 ||
+	    reader_pipe(reader->stop) == -1)
+		goto fail;
+
+	if (add_event_source(reader->wake[0], reader_drain, reader) == -1)
+		goto fail;
+
+	if ((errno = pthread_create(&reader->thread, NULL, reader_main,
+	    reader)) != 0) {
+		remove_event_source(reader->wake[0]);
+		goto fail;
+	}
+	reader->started = 1;
+	return reader;
+fail:
+	reader_free(reader);
+	return NULL;
+}
+
+void
+reader_free(struct reader *reader)
+{
+	size_t i;
+
+	if (reader->started) {
+		reader_notify(reader->stop[1]);
+		pthread_join(reader->thread, NULL);
+		remove_event_source(reader->wake[0]);
+	}
+
+	for (i = reader->tail; i != reader->head; i++) {
+		free(reader->ring[i % RING_SIZE].data);
+		free(reader->ring[i % RING_SIZE].ends);
+	}
+
+	reader_close_pipe(reader->wake);
+	reader_close_pipe(reader->space);
+	reader_close_pipe(reader->stop);
+	free(reader);
+}
+
+/*
+ * While paused, batches are left in the ring. Once it is full, the
+ * thread stops reading and the kernel blocks the writer.
+ */
+void
+reader_pause(struct reader *reader, int paused)
+{
+	reader->paused = paused;
+	event_set_enabled(reader->wake[0], !paused);
+}
+
+/*
+ * Returns how much of 's' can be passed on: up to the last line break,
+ * or if there is none and 'force' is set, up to the last complete
+ * UTF-8 character.
+ */
+static size_t
+reader_split(const char *s, size_t len, int force)
+{
+	size_t i, need;
+	unsigned char ch;
+
+	for (i = len; i > 0; i--)
+		if (s[i - 1] == '\n')
+			return i;
+	if (!force)
+		return 0;
+
+	/*
+	 * Leave out a trailing sequence that is not complete yet.
+	 */
+	for (i = len; i > 0 && len - i < 4; i--) {
+		ch = s[i - 1];
+		if ((ch & 0xc0) == 0x80)
+			continue;
+		if (ch >= 0xf0)
+			need = 4;
+		else if (ch >= 0xe0)
+			need = 3;
+		else if (ch >= 0xc0)
+			need = 2;
+		else
+			need = 1;
+		return len - (i - 1) < need ? i - 1 : len;
+	}
+	return len;
+}
+
+/*
+ * Returns the length of the well-formed UTF-8 sequence at 'p', or 0 if
+ * it is malformed, overlong, a surrogate or incomplete.
+ */
+static size_t
+reader_utf8_len(const unsigned char *p, size_t avail)
+{
+	uint32_t cp, min;
+	size_t need, i;
+
+	if (p[0] >= 0xc2 && p[0] <= 0xdf) {
+		need = 2;
+		min = 0x80;
+		cp = p[0] & 0x1f;
+	} else if (p[0] >= 0xe0 && p[0] <= 0xef) {
+		need = 3;
+		min = 0x800;
+		cp = p[0] & 0x0f;
+	} else if (p[0] >= 0xf0 && p[0] <= 0xf4) {
+		need = 4;
+		min = 0x10000;
+		cp = p[0] & 0x07;
+	} else
+		return 0;
+
+	if (avail < need)
+		return 0;
+	for (i = 1; i < need; i++) {
+		if ((p[i] & 0xc0) != 0x80)
+			return 0;
+		cp = cp << 6 | (p[i] & 0x3f);
+	}
+	if (cp < min || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff))
+		return 0;
+	return need;
+}
+
+/*
+ * Copies 's' to 'out' replacing each byte of malformed UTF-8 with
+ * U+FFFD, and stores offsets of line breaks in 'out' to 'ends'. With
+ * NULL 'out' only counts them. Returns the length of 'out'.
+ */
+static size_t
+reader_validate(const char *s, size_t len, char *out, size_t *ends,
+    size_t *nends)
+{
+	const unsigned char *p = (const unsigned char *) s;
+	size_t i, j, n;
+
+	*nends = 0;
+	for (i = 0, j = 0; i < len; i += n) {
+		if (p[i] < 0x80) {
+			if (p[i] == '\n') {
+				if (ends != NULL)
+					ends[*nends] = j;
+				(*nends)++;
+			}
+			if (out != NULL)
+				out[j] = p[i];
+			j++;
+			n = 1;
+		} else if ((n = reader_utf8_len(&p[i], len - i)) > 0) {
+			if (out != NULL)
+				memcpy(&out[j], &p[i], n);
+			j += n;
+		} else {
+			if (out != NULL)
+				memcpy(&out[j], "\xef\xbf\xbd", 3);
+			j += 3;
+			n = 1;
+		}
+	}
+	return j;
+}
+
+/*
+ * Waits until 'fd' is readable. Returns -1 when asked to stop.
+ */
+static int
+reader_wait(struct reader *reader, int fd)
+{
+	struct pollfd pfd[2];
+
+	pfd[0] = (struct pollfd) { fd, POLLIN, 0 };
+	pfd[1] = (struct pollfd) { reader->stop[0], POLLIN, 0 };
+	while (poll(pfd, 2, -1) == -1)
+		if (errno != EINTR)
+			return -1;
+	if (pfd[1].revents != 0)
+		return -1;
+	return 0;
+}
+
+/*
+ * Takes ownership of what 'batch' points to. Returns -1 when asked to
+ * stop.
+ */
+static int
+reader_push(struct reader *reader, struct batch *batch)
+{
+	size_t head;
+
+	head = reader->head;
+	while (head - __atomic_load_n(&reader->tail, __ATOMIC_ACQUIRE) ==
+	    RING_SIZE) {
+		__atomic_store_n(&reader->waiting, 1, __ATOMIC_SEQ_CST);
+		if (head - __atomic_load_n(&reader->tail, __ATOMIC_SEQ_CST) <
+		    RING_SIZE)
+			break;
+		if (reader_wait(reader, reader->space[0]) == -1) {
+			free(batch->data);
+			free(batch->ends);
+			return -1;
+		}
+		reader_clear(reader->space[0]);
+	}
+
+	reader->ring[head % RING_SIZE] = *batch;
+	__atomic_store_n(&reader->head, head + 1, __ATOMIC_RELEASE);
+	reader_notify(reader->wake[1]);
+	return 0;
+}
+
+/*
+ * Passes on a batch made of 's'. Returns -1 when asked to stop, or
+ * when out of memory, after passing on the end of file.
+ */
+static int
+reader_pass(struct reader *reader, const char *s, size_t len)
+{
+	struct batch batch;
+
+	batch.len = reader_validate(s, len, NULL, NULL, &batch.nends);
+	batch.ends = NULL;
+	if ((batch.data = malloc(batch.len)) == NULL ||
+	    (batch.nends > 0 && (batch.ends = calloc(batch.nends,
+	    sizeof(*batch.ends))) == NULL)) {
+		free(batch.data);
+		batch = (struct batch) { NULL, 0, NULL, 0 };
+		reader_push(reader, &batch);
+		return -1;
+	}
+	reader_validate(s, len, batch.data, batch.ends, &batch.nends);
+	return reader_push(reader, &batch);
+}
+
+static void *
+reader_main(void *arg)
+{
+	struct reader *reader = arg;
+	struct batch batch;
+	char *buf;
+	size_t used, n;
+	ssize_t nread;
+
+	if ((buf = malloc(READ_SIZE)) == NULL)
+		goto eof;
+
+	used = 0;
+	for (;;) {
+		if (reader_wait(reader, reader->fd) == -1)
+			break;
+		nread = read(reader->fd, &buf[used], READ_SIZE - used);
+		if (nread == -1 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		if (nread <= 0) {
+			/* Pass on what is left before the end. */
+			if (used > 0 && reader_pass(reader, buf, used) == -1)
+				break;
+			goto eof;
+		}
+		used += nread;
+
+		if ((n = reader_split(buf, used, used == READ_SIZE)) == 0)
+			continue;
+		if (reader_pass(reader, buf, n) == -1)
+			break;
+		memmove(buf, &buf[n], used - n);
+		used -= n;
+	}
+	free(buf);
+	return NULL;
+eof:
+	free(buf);
+	batch = (struct batch) { NULL, 0, NULL, 0 };
+	reader_push(reader, &batch);
+	return NULL;
+}
+
+/*
+ * Runs in the main thread. Batches beyond the event loop budget are
+ * left for the next round.
+ */
+static void
+reader_drain(int fd, void *udata)
+{
+	struct reader *reader = udata;
+	struct batch batch;
+	size_t tail, bytes;
+
+	reader_clear(fd);
+
+	bytes = 0;
+	tail = reader->tail;
+	while (tail != __atomic_load_n(&reader->head, __ATOMIC_ACQUIRE)) {
+		if (bytes >= EVENT_BYTE_BUDGET || reader->paused) {
+			reader_notify(reader->wake[1]);
+			break;
+		}
+
+		batch = reader->ring[tail % RING_SIZE];
+		tail++;
+		__atomic_store_n(&reader->tail, tail, __ATOMIC_SEQ_CST);
+		if (__atomic_exchange_n(&reader->waiting, 0,
+		    __ATOMIC_SEQ_CST))
+			reader_notify(reader->space[1]);
+
+		if (batch.data == NULL) {
+			/* The callback may free the reader. */
+			reader->callback(NULL, 0, NULL, 0, reader->udata);
+			return;
+		}
+		reader->callback(batch.data, batch.len, batch.ends,
+		    batch.nends, reader->udata);
+		free(batch.data);
+		free(batch.ends);
+		bytes += batch.len;
+	}
+}
+
+#endif
@@ -0,0 +1,43 @@
+/*
+ * vtsh - A mashup of virtual terminal and shell
+ * Copyright (c) 2022, Tommi Leino <namhas@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef READER_H
+#define READER_H
+
+#include "config.h"
+
+#include <stddef.h>
+
+#ifdef WANT_READER_THREADS
+
+struct reader;
+
+/*
+ * callback(s, len, ends, nends, udata) gets whole lines, or whole
+ * characters if a line is very long, as valid UTF-8 with offsets of
+ * line breaks in 'ends', and len 0 at end of file.
+ */
+typedef void (*ReaderCallback)(const char *, size_t, const size_t *,
+    size_t, void *);
+
+struct reader	*reader_create(int, ReaderCallback, void *);
+void		 reader_free(struct reader *);
+void		 reader_pause(struct reader *, int);
+
+#endif
+
+#endif
@@ -0,0 +1,316 @@
+/*
+ * vtsh - A mashup of virtual terminal and shell
+ * Copyright (c) 2022, Tommi Leino <namhas@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * rowcache.c: LRU cache of rendered rows as off-screen Pixmaps so that
+ * rows that did not change can be copied to the window instead of being
+ * shaped and drawn again.
+ */
+
+#include "rowcache.h"
+#include "dpy.h"
+#include "font.h"
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define ROWCACHE_BUCKETS 256
+
+struct rowentry {
+	struct rowentry	*prev;
+	struct rowentry	*next;
+	struct rowentry	*hnext;
+	unsigned long	 hash;
+	struct rowkey	 key;
+	struct rowrun	*runs;
+	char		*bytes;
+	Pixmap		 pixmap;
+	XftDraw		*ftdraw;
+	size_t		 mem;
+};
+
+static struct rowentry	*buckets[ROWCACHE_BUCKETS];
+static struct rowentry	*lru_head;
+static struct rowentry	*lru_tail;
+static size_t		 mem_used;
+static GC		 gc;
+
+extern struct dpy *dpy;
+
+static unsigned long	 rowcache_hash(const struct rowkey *);
+static int		 rowcache_match(struct rowentry *,
+			    const struct rowkey *, unsigned long);
+static void		 rowcache_unlink(struct rowentry *);
+static void		 rowcache_link_head(struct rowentry *);
+static void		 rowcache_unhash(struct rowentry *);
+static void		 rowcache_evict(struct rowentry *, int);
+static size_t		 rowcache_mem(const struct rowkey *);
+
+#define FNV_MIX(_h, _v) (((_h) ^ (unsigned long) (_v)) * 16777619UL)
+
+/*
+ * FNV-1a over the row contents, mixed with rest of the key.
+ */
+static unsigned long
+rowcache_hash(const struct rowkey *key)
+{
+	unsigned long h;
+	size_t i;
+
+	h = 2166136261UL;
+	for (i = 0; i < key->len; i++)
+		h = FNV_MIX(h, (unsigned char) key->bytes[i]);
+
+	for (i = 0; i < key->nruns; i++) {
+		h = FNV_MIX(h, key->runs[i].start);
+		h = FNV_MIX(h, key->runs[i].end);
+		h = FNV_MIX(h, key->runs[i].bgcolor);
+	}
+
+	h = FNV_MIX(h, key->begin_offset);
+	h = FNV_MIX(h, key->width);
+	h = FNV_MIX(h, key->height);
+	h = FNV_MIX(h, key->font);
+	h = FNV_MIX(h, key->bgcolor);
+
+	return h;
+}
+
+static int
+rowcache_match(struct rowentry *np, const struct rowkey *key,
+    unsigned long hash)
+{
+	const struct rowkey *k = &np->key;
+	size_t i;
+
+	if (np->hash != hash)
+		return 0;
+
+	if (k->len != key->len || k->nruns != key->nruns ||
+	    k->begin_offset != key->begin_offset ||
+	    k->width != key->width || k->height != key->height ||
+	    k->font != key->font || k->bgcolor != key->bgcolor)
+		return 0;
+
+	for (i = 0; i < key->nruns; i++)
+		if (k->runs[i].start != key->runs[i].start ||
+		    k->runs[i].end != key->runs[i].end ||
+		    k->runs[i].bgcolor != key->runs[i].bgcolor ||
+		    k->runs[i].ctrl != key->runs[i].ctrl)
+			return 0;
+
+	return (key->len == 0 || memcmp(np->bytes, key->bytes, key->len) == 0);
+}
+
+static size_t
+rowcache_mem(const struct rowkey *key)
+{
+	int depth;
+
+	depth = DefaultDepth(DPY(dpy), DPY_SCREEN(dpy));
+	return (size_t) key->width * key->height * ((depth + 7) / 8) +
+	    key->len + key->nruns * sizeof(struct rowrun) +
+	    sizeof(struct rowentry);
+}
+
+static void
+rowcache_unlink(struct rowentry *np)
+{
+	if (np->prev != NULL)
+		np->prev->next = np->next;
+	else
+		lru_head = np->next;
+
+	if (np->next != NULL)
+		np->next->prev = np->prev;
+	else
+		lru_tail = np->prev;
+
+	np->prev = np->next = NULL;
+}
+
+static void
+rowcache_link_head(struct rowentry *np)
+{
+	np->prev = NULL;
+	np->next = lru_head;
+	if (lru_head != NULL)
+		lru_head->prev = np;
+	lru_head = np;
+	if (lru_tail == NULL)
+		lru_tail = np;
+}
+
+static void
+rowcache_unhash(struct rowentry *np)
+{
+	struct rowentry **pp;
+
+	pp = &buckets[np->hash % ROWCACHE_BUCKETS];
+	while (*pp != NULL && *pp != np)
+		pp = &(*pp)->hnext;
+	assert(*pp == np);
+	*pp = np->hnext;
+}
+
+/*
+ * Removes entry from the cache. If 'free_pixmap' is not set, the
+ * caller has taken over the Pixmap and its XftDraw.
+ */
+static void
+rowcache_evict(struct rowentry *np, int free_pixmap)
+{
+	rowcache_unlink(np);
+	rowcache_unhash(np);
+	mem_used -= np->mem;
+
+	if (free_pixmap && np->ftdraw != NULL)
+		font_free_ftdraw(np->ftdraw);
+	if (free_pixmap && np->pixmap != None)
+		XFreePixmap(DPY(dpy), np->pixmap);
+	free(np->bytes);
+	free(np->runs);
+	free(np);
+}
+
+Pixmap
+rowcache_lookup(const struct rowkey *key)
+{
+	struct rowentry *np;
+	unsigned long hash;
+
+	if (key->len > ROWCACHE_MAX_ROW_BYTES)
+		return None;
+
+	hash = rowcache_hash(key);
+	for (np = buckets[hash % ROWCACHE_BUCKETS]; np != NULL; np = np->hnext)
+		if (rowcache_match(np, key, hash))
+			break;
+
+	if (np == NULL)
+		return None;
+
+	if (np != lru_head) {
+		rowcache_unlink(np);
+		rowcache_link_head(np);
+	}
+	return np->pixmap;
+}
+
+/*
+ * Returns a Pixmap and its XftDraw for the caller to render the row
+ * into, or None if the row should not be cached. Least recently used
+ * rows are evicted to keep within ROWCACHE_MAX_BYTES, and their Pixmaps
+ * are recycled when the size matches.
+ */
+Pixmap
+rowcache_insert(const struct rowkey *key, XftDraw **ftdraw)
+{
+	struct rowentry *np;
+	Pixmap pixmap;
+	XftDraw *pixmap_ftdraw;
+	size_t mem;
+
+	if (key->len > ROWCACHE_MAX_ROW_BYTES || key->width <= 0 ||
+	    key->height <= 0)
+		return None;
+
+	mem = rowcache_mem(key);
+	if (mem > ROWCACHE_MAX_BYTES)
+		return None;
+
+	if ((np = calloc(1, sizeof(*np))) == NULL)
+		return None;
+	if ((key->len > 0 && (np->bytes = malloc(key->len)) == NULL) ||
+	    (key->nruns > 0 && (np->runs = calloc(key->nruns,
+	    sizeof(*np->runs))) == NULL)) {
+		free(np->bytes);
+		free(np);
+		return None;
+	}
+
+	pixmap = None;
+	pixmap_ftdraw = NULL;
+	while (lru_tail != NULL && mem_used + mem > ROWCACHE_MAX_BYTES) {
+		if (pixmap == None && lru_tail->key.width == key->width &&
+		    lru_tail->key.height == key->height) {
+			pixmap = lru_tail->pixmap;
+			pixmap_ftdraw = lru_tail->ftdraw;
+			rowcache_evict(lru_tail, 0);
+		} else
+			rowcache_evict(lru_tail, 1);
+	}
+
+	if (pixmap == None) {
+		pixmap = XCreatePixmap(DPY(dpy), DPY_ROOT(dpy), key->width,
+		    key->height, DefaultDepth(DPY(dpy), DPY_SCREEN(dpy)));
+		pixmap_ftdraw = font_create_ftdraw(pixmap);
+	}
+
+	np->key = *key;
+	if (key->len > 0)
+		memcpy(np->bytes, key->bytes, key->len);
+	if (key->nruns > 0)
+		memcpy(np->runs, key->runs, key->nruns * sizeof(*np->runs));
+	np->key.bytes = np->bytes;
+	np->key.runs = np->runs;
+	np->hash = rowcache_hash(key);
+	np->pixmap = pixmap;
+	np->ftdraw = pixmap_ftdraw;
+	np->mem = mem;
+
+	np->hnext = buckets[np->hash % ROWCACHE_BUCKETS];
+	buckets[np->hash % ROWCACHE_BUCKETS] = np;
+	rowcache_link_head(np);
+	mem_used += mem;
+
+	*ftdraw = pixmap_ftdraw;
+	return pixmap;
+}
+
+/*
+ * Copies rendered row to a window. We use our own GC without graphics
+ * exposures because the source is never obscured.
+ */
+void
+rowcache_put(Pixmap pixmap, Window window, int x, int y, int width,
+    int height)
+{
+	XGCValues v;
+
+	if (gc == NULL) {
+		v.graphics_exposures = False;
+		gc = XCreateGC(DPY(dpy), DPY_ROOT(dpy), GCGraphicsExposures,
+		    &v);
+	}
+
+	XCopyArea(DPY(dpy), pixmap, window, gc, 0, 0, width, height, x, y);
+}
+
+void
+rowcache_flush()
+{
+	while (lru_tail != NULL)
+		rowcache_evict(lru_tail, 1);
+
+	if (gc != NULL) {
+		XFreeGC(DPY(dpy), gc);
+		gc = NULL;
+	}
+}
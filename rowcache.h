@@ -0,0 +1,57 @@
+/*
+ * vtsh - A mashup of virtual terminal and shell
+ * Copyright (c) 2022, Tommi Leino <namhas@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ROWCACHE_H
+#define ROWCACHE_H
+
+#include <X11/Xlib.h>
+#include <X11/Xft/Xft.h>
+
+#include <stddef.h>
+
+/*
+ * Background color for bytes from 'start' to 'end' within a row. Control
+ * characters have runs of their own.
+ */
+struct rowrun {
+	size_t		 start;
+	size_t		 end;
+	int		 bgcolor;
+	int		 ctrl;
+};
+
+/*
+ * Everything that affects how a rendered row looks like.
+ */
+struct rowkey {
+	const char		*bytes;
+	size_t			 len;
+	const struct rowrun	*runs;
+	size_t			 nruns;
+	size_t			 begin_offset;
+	int			 width;
+	int			 height;
+	int			 font;
+	int			 bgcolor;
+};
+
+Pixmap	rowcache_lookup(const struct rowkey *);
+Pixmap	rowcache_insert(const struct rowkey *, XftDraw **);
+void	rowcache_put(Pixmap, Window, int, int, int, int);
+void	rowcache_flush(void);
+
+#endif
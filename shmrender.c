@@ -0,0 +1,453 @@
+/*
+ * vtsh - A mashup of virtual terminal and shell
+ * Copyright (c) 2022, Tommi Leino <namhas@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * shmrender.c: Renders text on the client side into an MIT-SHM image
+ * so that a full repaint is sent to the X server with one
+ * XShmPutImage instead of thousands of small XRender requests. Glyphs
+ * are rasterized with FreeType once and kept in a glyph atlas.
+ *
+ * While rendering, font_draw() and font_clear() calls for the target
+ * given to shmrender_begin() are redirected here. If MIT-SHM can not
+ * be used, e.g. on a remote display or with an unusual visual,
+ * shmrender_begin() fails and the caller draws with Xft as usual.
+ */
+
+#include "shmrender.h"
+
+#ifdef USE_SHM_RENDER
+
+#include "dpy.h"
+#include "font.h"
+#include "util.h"
+
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <err.h>
+
+/*
+ * 8-bit coverage of a glyph stored in the atlas at 'offset'.
+ */
+struct glyph {
+	XftFont		*font;
+	FT_UInt		 index;
+	int		 used;
+	int		 left;
+	int		 top;
+	int		 width;
+	int		 height;
+	int		 advance;
+	size_t		 offset;
+};
+
+static XImage		*image;
+static XShmSegmentInfo	 shminfo;
+static int		 disabled;
+static int		 busy;
+static int		 shm_error;
+static int		 image_width;
+static int		 image_height;
+static int		 width;
+static int		 height;
+
+static struct glyph	*glyphs;
+static size_t		 nglyphs;
+static size_t		 glyphs_alloc;
+static unsigned char	*atlas;
+static size_t		 atlas_used;
+static size_t		 atlas_alloc;
+
+extern struct dpy *dpy;
+
+static int		 shmrender_init(void);
+static int		 shmrender_alloc(int, int);
+static void		 shmrender_free_image(void);
+static int		 shmrender_error(Display *, XErrorEvent *);
+static struct glyph	*shmrender_glyph(XftFont *, FT_UInt);
+static struct glyph	*shmrender_probe(XftFont *, FT_UInt);
+static void		 shmrender_rasterize(struct glyph *);
+static void		 shmrender_blend(struct glyph *, XftColor *, int, int);
+
+/*
+ * Only 32 bits per pixel TrueColor images in our own byte order are
+ * handled, which is what practically every local X server has.
+ */
+static int
+shmrender_init(void)
+{
+	Visual *visual;
+	uint32_t one = 1;
+	int little_endian;
+
+	visual = DefaultVisual(DPY(dpy), DPY_SCREEN(dpy));
+	if (!XShmQueryExtension(DPY(dpy)) || visual->class != TrueColor ||
+	    visual->red_mask != 0xff0000 || visual->green_mask != 0xff00 ||
+	    visual->blue_mask != 0xff)
+		return -1;
+
+	if (shmrender_alloc(1, 1) == -1)
+		return -1;
+
+	little_endian = *(unsigned char *) &one == 1;
+	if (image->bits_per_pixel != 32 ||
+	    image->byte_order != (little_endian ? LSBFirst : MSBFirst)) {
+		shmrender_free_image();
+		return -1;
+	}
+	return 0;
+}
+
+static int
+shmrender_error(Display *display, XErrorEvent *e)
+{
+	shm_error = 1;
+	return 0;
+}
+
+static int
+shmrender_alloc(int w, int h)
+{
+	int (*old_handler)(Display *, XErrorEvent *);
+
+	shmrender_free_image();
+
+	image = XShmCreateImage(DPY(dpy), DefaultVisual(DPY(dpy),
+	    DPY_SCREEN(dpy)), DefaultDepth(DPY(dpy), DPY_SCREEN(dpy)),
+	    ZPixmap, NULL, &shminfo, w, h);
+	if (image == NULL)
+		return -1;
+
+	shminfo.shmid = shmget(IPC_PRIVATE, image->bytes_per_line * h,
+	    IPC_CREAT | 0600);
+	if (shminfo.shmid == -1) {
+		XDestroyImage(image);
+		image = NULL;
+		return -1;
+	}
+	shminfo.shmaddr = image->data = shmat(shminfo.shmid, NULL, 0);
+	shminfo.readOnly = False;
+	if (shminfo.shmaddr == (void *) -1) {
+		shmctl(shminfo.shmid, IPC_RMID, NULL);
+		image->data = NULL;
+		XDestroyImage(image);
+		image = NULL;
+		return -1;
+	}
+
+	/*
+	 * Attaching fails e.g. if the X server is on another host, and
+	 * the error would otherwise be fatal.
+	 */
+	shm_error = 0;
+	old_handler = XSetErrorHandler(shmrender_error);
+	XShmAttach(DPY(dpy), &shminfo);
+	XSync(DPY(dpy), False);
+	XSetErrorHandler(old_handler);
+
+	/* Goes away when both we and the X server detach. */
+	shmctl(shminfo.shmid, IPC_RMID, NULL);
+
+	if (shm_error) {
+		shmdt(shminfo.shmaddr);
+		image->data = NULL;
+		XDestroyImage(image);
+		image = NULL;
+		return -1;
+	}
+
+	image_width = w;
+	image_height = h;
+	return 0;
+}
+
+static void
+shmrender_free_image(void)
+{
+	if (image == NULL)
+		return;
+
+	XShmDetach(DPY(dpy), &shminfo);
+	XSync(DPY(dpy), False);
+	shmdt(shminfo.shmaddr);
+	image->data = NULL;
+	XDestroyImage(image);
+	image = NULL;
+	busy = 0;
+}
+
+/*
+ * Starts rendering an area of 'w' times 'h' pixels. Returns -1 if
+ * the caller should draw with Xft instead.
+ */
+int
+shmrender_begin(XftDraw *target, int w, int h)
+{
+	if (disabled || w <= 0 || h <= 0)
+		return -1;
+
+	if (image == NULL && shmrender_init() == -1) {
+		disabled = 1;
+		return -1;
+	}
+
+	if (w > image_width || h > image_height) {
+		if (shmrender_alloc(MAX(w, image_width),
+		    MAX(h, image_height)) == -1) {
+			disabled = 1;
+			return -1;
+		}
+	}
+
+	/*
+	 * The X server may still be reading the previous image.
+	 */
+	if (busy) {
+		XSync(DPY(dpy), False);
+		busy = 0;
+	}
+
+	width = w;
+	height = h;
+	font_set_image_target(target);
+	return 0;
+}
+
+/*
+ * Sends the rendered area to 'drawable' at 'x', 'y'.
+ */
+void
+shmrender_end(Drawable drawable, GC gc, int x, int y)
+{
+	font_set_image_target(NULL);
+
+	XShmPutImage(DPY(dpy), drawable, gc, image, 0, 0, x, y, width,
+	    height, False);
+	busy = 1;
+}
+
+void
+shmrender_rect(XftColor *color, int x, int y, int w, int h)
+{
+	uint32_t *row, pixel;
+	int i, j, x2, y2;
+
+	x2 = MIN(x + w, width);
+	y2 = MIN(y + h, height);
+	x = MAX(x, 0);
+	y = MAX(y, 0);
+
+	pixel = color->pixel;
+	for (j = y; j < y2; j++) {
+		row = (uint32_t *) (image->data + j * image->bytes_per_line);
+		for (i = x; i < x2; i++)
+			row[i] = pixel;
+	}
+}
+
+/*
+ * Draws UTF-8 text on 'bg' with its top left corner at 'x', 'y' and
+ * returns its width like font_draw() does.
+ */
+int
+shmrender_text(XftFont *font, XftColor *fg, XftColor *bg, int x, int y,
+    const char *text, size_t len)
+{
+	XGlyphInfo extents;
+	struct glyph *glyph;
+	FcChar32 ucs4;
+	size_t i;
+	int n;
+
+	XftTextExtentsUtf8(DPY(dpy), font, (const FcChar8 *) text, len,
+	    &extents);
+	shmrender_rect(bg, x, y, extents.xOff, font->height);
+
+	y += font->ascent;
+	for (i = 0; i < len; i += n) {
+		if ((n = FcUtf8ToUcs4((const FcChar8 *) &text[i], &ucs4,
+		    len - i)) <= 0)
+			break;
+		glyph = shmrender_glyph(font, XftCharIndex(DPY(dpy), font,
+		    ucs4));
+		shmrender_blend(glyph, fg, x, y);
+		x += glyph->advance;
+	}
+
+	return extents.xOff;
+}
+
+/*
+ * Returns the slot of the glyph, or the free slot where it belongs.
+ */
+static struct glyph *
+shmrender_probe(XftFont *font, FT_UInt index)
+{
+	size_t i, mask;
+
+	mask = glyphs_alloc - 1;
+	i = (((uintptr_t) font >> 4) * 31 + index) & mask;
+	while (glyphs[i].used) {
+		if (glyphs[i].font == font && glyphs[i].index == index)
+			break;
+		i = (i + 1) & mask;
+	}
+	return &glyphs[i];
+}
+
+/*
+ * Finds glyph from the atlas, rasterizing it on first use. The table
+ * is open addressed and kept at most half full.
+ */
+static struct glyph *
+shmrender_glyph(XftFont *font, FT_UInt index)
+{
+	struct glyph *old, *glyph;
+	size_t i, n;
+
+	if (nglyphs * 2 >= glyphs_alloc) {
+		old = glyphs;
+		n = glyphs_alloc;
+		glyphs_alloc = n > 0 ? n * 2 : 256;
+		if ((glyphs = calloc(glyphs_alloc, sizeof(*glyphs))) == NULL)
+			err(1, "calloc");
+		for (i = 0; i < n; i++)
+			if (old[i].used)
+				*shmrender_probe(old[i].font, old[i].index) =
+				    old[i];
+		free(old);
+	}
+
+	glyph = shmrender_probe(font, index);
+	if (glyph->used)
+		return glyph;
+
+	glyph->used = 1;
+	glyph->font = font;
+	glyph->index = index;
+	nglyphs++;
+	shmrender_rasterize(glyph);
+	return glyph;
+}
+
+static void
+shmrender_rasterize(struct glyph *glyph)
+{
+	XGlyphInfo extents;
+	FT_Face face;
+	FT_Bitmap *bitmap;
+	unsigned char *src, *dst;
+	int x, y;
+
+	XftGlyphExtents(DPY(dpy), glyph->font, &glyph->index, 1, &extents);
+	glyph->advance = extents.xOff;
+	glyph->width = glyph->height = 0;
+	glyph->offset = 0;
+
+	if ((face = XftLockFace(glyph->font)) == NULL)
+		return;
+	if (FT_Load_Glyph(face, glyph->index, FT_LOAD_RENDER) != 0) {
+		XftUnlockFace(glyph->font);
+		return;
+	}
+
+	bitmap = &face->glyph->bitmap;
+	glyph->left = face->glyph->bitmap_left;
+	glyph->top = face->glyph->bitmap_top;
+	glyph->width = bitmap->width;
+	glyph->height = bitmap->rows;
+
+	while (atlas_alloc < atlas_used + glyph->width * glyph->height)
+		if (grow_array((void **) &atlas, 1, &atlas_alloc) == -1)
+			err(1, "grow_array");
+	glyph->offset = atlas_used;
+	atlas_used += glyph->width * glyph->height;
+
+	dst = &atlas[glyph->offset];
+	for (y = 0; y < glyph->height; y++) {
+		src = bitmap->buffer + y * bitmap->pitch;
+		for (x = 0; x < glyph->width; x++) {
+			if (bitmap->pixel_mode == FT_PIXEL_MODE_MONO)
+				*dst++ = (src[x / 8] & (0x80 >> (x % 8))) ?
+				    255 : 0;
+			else
+				*dst++ = src[x];
+		}
+	}
+
+	XftUnlockFace(glyph->font);
+}
+
+/*
+ * Blends glyph coverage in 'fg' color over the image, with the glyph
+ * origin at 'x' and baseline at 'y'.
+ */
+static void
+shmrender_blend(struct glyph *glyph, XftColor *fg, int x, int y)
+{
+	const unsigned char *src;
+	uint32_t *row, d;
+	unsigned int a, r, g, b;
+	int i, j, px, py;
+
+	r = fg->color.red >> 8;
+	g = fg->color.green >> 8;
+	b = fg->color.blue >> 8;
+
+	x += glyph->left;
+	y -= glyph->top;
+	for (j = 0; j < glyph->height; j++) {
+		py = y + j;
+		if (py < 0 || py >= height)
+			continue;
+		row = (uint32_t *) (image->data + py * image->bytes_per_line);
+		src = &atlas[glyph->offset + j * glyph->width];
+		for (i = 0; i < glyph->width; i++) {
+			px = x + i;
+			if ((a = src[i]) == 0 || px < 0 || px >= width)
+				continue;
+			d = row[px];
+			row[px] =
+			    ((((d >> 16) & 0xff) * (255 - a) + r * a) / 255)
+			    << 16 |
+			    ((((d >> 8) & 0xff) * (255 - a) + g * a) / 255)
+			    << 8 |
+			    (((d & 0xff) * (255 - a) + b * a) / 255);
+		}
+	}
+}
+
+void
+shmrender_close(void)
+{
+	shmrender_free_image();
+
+	free(glyphs);
+	glyphs = NULL;
+	nglyphs = glyphs_alloc = 0;
+	free(atlas);
+	atlas = NULL;
+	atlas_used = atlas_alloc = 0;
+}
+
+#endif
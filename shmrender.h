@@ -0,0 +1,39 @@
+/*
+ * vtsh - A mashup of virtual terminal and shell
+ * Copyright (c) 2022, Tommi Leino <namhas@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SHMRENDER_H
+#define SHMRENDER_H
+
+#include "config.h"
+
+#include <X11/Xlib.h>
+#include <X11/Xft/Xft.h>
+
+#include <stddef.h>
+
+#if defined(WANT_SHM_RENDER) && defined(HAVE_XSHM)
+#define USE_SHM_RENDER
+
+int	shmrender_begin(XftDraw *, int, int);
+void	shmrender_end(Drawable, GC, int, int);
+void	shmrender_rect(XftColor *, int, int, int, int);
+int	shmrender_text(XftFont *, XftColor *, XftColor *, int, int,
+	    const char *, size_t);
+void	shmrender_close(void);
+#endif
+
+#endif
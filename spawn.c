@@ -0,0 +1,181 @@
+/*
+ * vtsh - A mashup of virtual terminal and shell
+ * Copyright (c) 2022, Tommi Leino <namhas@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * spawn.c: Starts commands in a new pty without fork(2), which would
+ * have to copy the page tables of all the text we hold and gets slower
+ * the longer vtsh runs. posix_spawn(3) with POSIX_SPAWN_SETSID is used
+ * where available, and vfork(2) elsewhere.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE		/* POSIX_SPAWN_SETSID, posix_openpt */
+#endif
+
+#include "spawn.h"
+#include "child.h"
+
+#include <sys/ioctl.h>
+
+#include <spawn.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+extern char **environ;
+
+static char	**spawn_env(char *const []);
+
+/*
+ * Returns the environment with variables in 'env' replaced.
+ */
+static char **
+spawn_env(char *const env[])
+{
+	char **envp;
+	size_t i, j, k, n, nenv, len;
+
+	for (nenv = 0; env[nenv] != NULL; nenv++)
+		;
+	for (n = 0; environ[n] != NULL; n++)
+		;
+
+	if ((envp = calloc(n + nenv + 1, sizeof(*envp))) == NULL)
+		return NULL;
+
+	for (k = 0; k < nenv; k++)
+		envp[k] = env[k];
+
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < nenv; j++) {
+			len = strcspn(env[j], "=") + 1;
+			if (strncmp(environ[i], env[j], len) == 0)
+				break;
+		}
+		if (j == nenv)
+			envp[k++] = environ[i];
+	}
+
+	return envp;
+}
+
+/*
+ * Runs 'path' with 'argv' and the extra environment 'env' as a session
+ * leader with a new pty as its controlling terminal. Returns the pid,
+ * or -1 with errno set.
+ */
+pid_t
+spawn_pty(const struct termios *ts, const char *path, char *const argv[],
+    char *const env[], int *ptyfd_out)
+{
+	char **envp, *name;
+	pid_t pid;
+	int master, slave, saved_errno;
+#ifdef POSIX_SPAWN_SETSID
+	posix_spawn_file_actions_t fa;
+	posix_spawnattr_t attr;
+	sigset_t mask;
+	int i;
+#endif
+
+	slave = -1;
+	envp = NULL;
+	pid = -1;
+
+	if ((master = posix_openpt(O_RDWR | O_NOCTTY)) == -1)
+		return -1;
+	if (fcntl(master, F_SETFD, FD_CLOEXEC) == -1 ||
+	    grantpt(master) == -1 || unlockpt(master) == -1 ||
+	    (name = ptsname(master)) == NULL)
+		goto fail;
+	if ((slave = open(name, O_RDWR | O_NOCTTY)) == -1)
+		goto fail;
+	if (ts != NULL && tcsetattr(slave, TCSANOW, ts) == -1)
+		goto fail;
+	if ((envp = spawn_env(env)) == NULL)
+		goto fail;
+
+#ifdef POSIX_SPAWN_SETSID
+	/*
+	 * A session leader opening a tty without O_NOCTTY makes it its
+	 * controlling terminal.
+	 */
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, name, O_RDWR, 0);
+	posix_spawn_file_actions_adddup2(&fa, STDIN_FILENO, STDOUT_FILENO);
+	posix_spawn_file_actions_adddup2(&fa, STDIN_FILENO, STDERR_FILENO);
+
+	posix_spawnattr_init(&attr);
+	sigemptyset(&mask);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGPIPE);
+	posix_spawnattr_setsigdefault(&attr, &mask);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID |
+	    POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+	close(slave);
+	slave = -1;
+
+	if ((i = posix_spawn(&pid, path, &fa, &attr, argv, envp)) != 0) {
+		errno = i;
+		pid = -1;
+	}
+
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&fa);
+	if (pid == -1)
+		goto fail;
+#else
+	/*
+	 * Only async-signal-safe calls between vfork and exec.
+	 */
+	if ((pid = vfork()) == -1)
+		goto fail;
+	if (pid == 0) {
+		setsid();
+#ifdef TIOCSCTTY
+		ioctl(slave, TIOCSCTTY, 0);
+#endif
+		dup2(slave, STDIN_FILENO);
+		dup2(slave, STDOUT_FILENO);
+		dup2(slave, STDERR_FILENO);
+		if (slave > STDERR_FILENO)
+			close(slave);
+		child_reset_signals();
+		execve(path, argv, envp);
+		_exit(127);
+	}
+	close(slave);
+	slave = -1;
+#endif
+
+	free(envp);
+	*ptyfd_out = master;
+	return pid;
+fail:
+	saved_errno = errno;
+	free(envp);
+	if (slave != -1)
+		close(slave);
+	close(master);
+	errno = saved_errno;
+	return -1;
+}
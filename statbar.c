@@ -18,9 +18,18 @@
 #include "statbar.h"
 #include "widget.h"
 #include "label.h"
+#include "event.h"
+#include "config.h"
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <err.h>
+
+static void	 statbar_schedule(struct statbar *);
+static void	 statbar_timer(void *);
+static void	 statbar_draw(struct statbar *);
+static void	 statbar_size(char *, size_t, double);
+static long	 statbar_elapsed_ms(struct statbar *, struct timespec *);
 
 struct statbar *
 statbar_create(const char *name, struct widget *parent)
@@ -43,28 +52,157 @@ void
 statbar_update_status(struct statbar *statbar, StatbarState state,
 	int pid, int ret, int lines)
 {
-	char status[256], str[256];
-
-	if (pid != 0)
-		snprintf(status, sizeof(status), "%dL %d", lines, pid);
-	else if (state == STATBAR_STATE_EXITED)
-		snprintf(status, sizeof(status), "%dL E%d", lines, ret);
-	else if (state == STATBAR_STATE_SIGNALED)
-		snprintf(status, sizeof(status), "%dL S%d", lines, ret);
-	else if (state == STATBAR_STATE_FILE_SAVED)
-		snprintf(status, sizeof(status), "%dL", lines);
-	else if (state == STATBAR_STATE_FILE_UNSAVED)
-		snprintf(status, sizeof(status), "%dL *", lines);
+	statbar->state = state;
+	statbar->pid = pid;
+	statbar->ret = ret;
+	statbar->lines = lines;
+	statbar_schedule(statbar);
+}
+
+/*
+ * Records totals of bytes and lines read from the command, and memory
+ * used by the buffer. Rates are derived from them when drawing.
+ */
+void
+statbar_update_metrics(struct statbar *statbar, size_t bytes_in,
+    size_t lines_in, size_t memory)
+{
+	statbar->bytes_in = bytes_in;
+	statbar->lines_in = lines_in;
+	statbar->memory = memory;
+	statbar_schedule(statbar);
+}
+
+void
+statbar_set_paused(struct statbar *statbar, int paused)
+{
+	statbar->paused = paused;
+	statbar_schedule(statbar);
+}
+
+static long
+statbar_elapsed_ms(struct statbar *statbar, struct timespec *now)
+{
+	return (now->tv_sec - statbar->drawn.tv_sec) * 1000 +
+	    (now->tv_nsec - statbar->drawn.tv_nsec) / 1000000;
+}
+
+/*
+ * Draws now if the previous draw was long enough ago, otherwise when
+ * the interval is over.
+ */
+static void
+statbar_schedule(struct statbar *statbar)
+{
+	struct timespec now;
+	long elapsed_ms;
+
+	if (statbar->timer != 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed_ms = statbar_elapsed_ms(statbar, &now);
+	if (elapsed_ms >= STATBAR_INTERVAL_MS || elapsed_ms < 0 ||
+	    (statbar->drawn.tv_sec == 0 && statbar->drawn.tv_nsec == 0)) {
+		statbar_draw(statbar);
+		return;
+	}
+
+	if ((statbar->timer = add_timer(STATBAR_INTERVAL_MS - elapsed_ms,
+	    statbar_timer, statbar)) == -1)
+		err(1, "add_timer");
+}
+
+static void
+statbar_timer(void *udata)
+{
+	struct statbar *statbar = udata;
+
+	statbar->timer = 0;
+	statbar_draw(statbar);
+}
+
+static void
+statbar_size(char *s, size_t sz, double bytes)
+{
+	if (bytes >= 1024 * 1024 * 1024)
+		snprintf(s, sz, "%.1fG", bytes / (1024 * 1024 * 1024));
+	else if (bytes >= 1024 * 1024)
+		snprintf(s, sz, "%.1fM", bytes / (1024 * 1024));
+	else if (bytes >= 1024)
+		snprintf(s, sz, "%.1fK", bytes / 1024);
+	else
+		snprintf(s, sz, "%.0fB", bytes);
+}
+
+static void
+statbar_draw(struct statbar *statbar)
+{
+	char status[256], str[256], rate[16], total[16], memory[16];
+	struct timespec now;
+	double secs, bytes_rate, lines_rate;
+	long elapsed_ms;
+	int n;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed_ms = statbar_elapsed_ms(statbar, &now);
+	secs = elapsed_ms > 0 ? elapsed_ms / 1000.0 : 1;
+
+	if (statbar->pid != 0)
+		n = snprintf(status, sizeof(status), "%dL %d", statbar->lines,
+		    statbar->pid);
+	else if (statbar->state == STATBAR_STATE_EXITED)
+		n = snprintf(status, sizeof(status), "%dL E%d",
+		    statbar->lines, statbar->ret);
+	else if (statbar->state == STATBAR_STATE_SIGNALED)
+		n = snprintf(status, sizeof(status), "%dL S%d",
+		    statbar->lines, statbar->ret);
+	else if (statbar->state == STATBAR_STATE_FILE_UNSAVED)
+		n = snprintf(status, sizeof(status), "%dL *", statbar->lines);
 	else
-		snprintf(status, sizeof(status), "%dL", lines);
+		n = snprintf(status, sizeof(status), "%dL", statbar->lines);
+
+	if (statbar->paused && n > 0 && (size_t)n < sizeof(status))
+		n += snprintf(&status[n], sizeof(status) - n, " paused");
+
+	/* Totals start over when the buffer is recreated. */
+	if (statbar->bytes_in < statbar->drawn_bytes_in ||
+	    statbar->lines_in < statbar->drawn_lines_in)
+		statbar->drawn_bytes_in = statbar->drawn_lines_in = 0;
+
+	bytes_rate = lines_rate = 0;
+	if (statbar->bytes_in > 0 && n > 0 && (size_t)n < sizeof(status)) {
+		bytes_rate = (statbar->bytes_in - statbar->drawn_bytes_in) /
+		    secs;
+		lines_rate = (statbar->lines_in - statbar->drawn_lines_in) /
+		    secs;
+		statbar_size(rate, sizeof(rate), bytes_rate);
+		statbar_size(total, sizeof(total), statbar->bytes_in);
+		statbar_size(memory, sizeof(memory), statbar->memory);
+		snprintf(&status[n], sizeof(status) - n,
+		    " %s/s %.0fL/s %s mem %s", rate, lines_rate, total,
+		    memory);
+	}
 
 	snprintf(str, sizeof(str), "%-12s", status);
 	label_set(statbar->label, str);
+
+	statbar->drawn = now;
+	statbar->drawn_bytes_in = statbar->bytes_in;
+	statbar->drawn_lines_in = statbar->lines_in;
+
+	/* Let the rates fall back to zero when output stops. */
+	if (bytes_rate > 0 && statbar->timer == 0 &&
+	    (statbar->timer = add_timer(STATBAR_INTERVAL_MS, statbar_timer,
+	    statbar)) == -1)
+		err(1, "add_timer");
 }
 
 void
 statbar_free(struct statbar *statbar)
 {
+	if (statbar->timer != 0)
+		cancel_timer(statbar->timer);
 	if (statbar->label != NULL)
 		label_free(statbar->label);
 	free(statbar);
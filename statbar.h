@@ -18,12 +18,10 @@
 #ifndef STATBAR_H
 #define STATBAR_H
 
-struct widget;
+#include <stddef.h>
+#include <time.h>
 
-struct statbar {
-	struct widget *widget;
-	struct label *label;
-};
+struct widget;
 
 typedef enum statbar_state {
 	STATBAR_STATE_NOT_STARTED,
@@ -34,9 +32,35 @@ typedef enum statbar_state {
 	STATBAR_STATE_SIGNALED
 } StatbarState;
 
+struct statbar {
+	struct widget *widget;
+	struct label *label;
+
+	/*
+	 * Updates only record the values, which are drawn at most once
+	 * per STATBAR_INTERVAL_MS.
+	 */
+	StatbarState state;
+	int pid;
+	int ret;
+	int lines;
+	int paused;
+	size_t bytes_in;
+	size_t lines_in;
+	size_t memory;
+
+	int timer;
+	struct timespec drawn;
+	size_t drawn_bytes_in;
+	size_t drawn_lines_in;
+};
+
 struct statbar	*statbar_create(const char *, struct widget *);
 void		 statbar_free(struct statbar *);
 void		 statbar_update_status(struct statbar *, StatbarState,
 		    int, int, int);
+void		 statbar_update_metrics(struct statbar *, size_t, size_t,
+		    size_t);
+void		 statbar_set_paused(struct statbar *, int);
 
 #endif
@@ -35,6 +35,7 @@
 #include <string.h>
 #include <assert.h>
 #include <err.h>
+#include <time.h>
 
 #ifdef DEBUG
 #include <stdio.h>
@@ -72,8 +73,11 @@ static void		 widget_enable_hints(struct widget *);
 static void		 widget_takefocus(Time, void *);
 
 static void		 widget_root_idle(void *);
+static int		 widget_frame_due(struct widget *);
+static void		 widget_frame_timer(void *);
 
 static void		 widget_flush_expose(struct widget *);
+static void		 widget_run_frame(struct widget *);
 static void		 widget_flush_changes(struct widget *);
 
 #ifdef DEBUG
@@ -100,17 +104,61 @@ widget_expose(XExposeEvent *e, void *udata)
 {
 	struct widget *widget = udata;
 
-	widget->expose_from_px = MIN(widget->expose_from_px, e->y);
-	widget->expose_to_px = MAX(widget->expose_to_px, (e->y + e->height));
-	widget->need_expose = 1;
+	widget_damage(widget, e->y, e->y + e->height);
 	widget->need_expose_from_event = 1;
 #ifdef DEBUG
 	printf("Expose ");
 	widget_print_name(widget);
-	printf(" (%d->%d)\n", widget->expose_from_px, widget->expose_to_px);
+	printf(" (%d->%d)\n", e->y, e->y + e->height);
 #endif
 }
 
+/*
+ * Marks pixel rows from 'from' to 'to' to be redrawn on next flush.
+ * Overlapping and adjacent areas are joined, and if there are too many
+ * separate areas, the two closest to each other are merged.
+ */
+void
+widget_damage(struct widget *widget, int from, int to)
+{
+	struct damage *d = widget->damage;
+	int i, j, k;
+
+	if (from >= to)
+		return;
+
+	widget->need_expose = 1;
+
+	for (i = 0; i < widget->ndamage && d[i].to_px < from; i++)
+		;
+	for (j = i; j < widget->ndamage && d[j].from_px <= to; j++) {
+		from = MIN(from, d[j].from_px);
+		to = MAX(to, d[j].to_px);
+	}
+
+	if (j > i) {
+		memmove(&d[i+1], &d[j], (widget->ndamage - j) * sizeof(*d));
+		widget->ndamage -= j - i - 1;
+	} else {
+		memmove(&d[i+1], &d[i], (widget->ndamage - i) * sizeof(*d));
+		widget->ndamage++;
+	}
+	d[i].from_px = from;
+	d[i].to_px = to;
+
+	if (widget->ndamage > WIDGET_MAX_DAMAGE) {
+		k = 0;
+		for (i = 1; i < widget->ndamage - 1; i++)
+			if (d[i+1].from_px - d[i].to_px <
+			    d[k+1].from_px - d[k].to_px)
+				k = i;
+		d[k].to_px = d[k+1].to_px;
+		memmove(&d[k+1], &d[k+2], (widget->ndamage - k - 2) *
+		    sizeof(*d));
+		widget->ndamage--;
+	}
+}
+
 static void
 widget_update_prefer(struct widget *widget)
 {
@@ -118,6 +166,21 @@ widget_update_prefer(struct widget *widget)
 		widget->update_prefer(widget->update_prefer_udata);
 }
 
+/*
+ * Refreshes preferred sizes bottom-up, because widgets may have skipped
+ * keeping them up to date while they were hidden.
+ */
+static void
+widget_update_prefer_tree(struct widget *widget)
+{
+	int i;
+
+	for (i = 0; i < widget->nchildren; i++)
+		widget_update_prefer_tree(widget->children[i]);
+
+	widget_update_prefer(widget);
+}
+
 static void
 widget_call_geometry(struct widget *widget)
 {
@@ -266,6 +329,11 @@ widget_keypress(XKeyEvent *xkey, void *udata)
 
 	assert(widget->parent == NULL);
 
+	/*
+	 * Echo must not wait for the next frame.
+	 */
+	widget->frame_urgent = 1;
+
 	widget_ensure_focus(widget);
 	focus = widget->focus;
 	if (focus == NULL)
@@ -281,23 +349,42 @@ widget_keypress(XKeyEvent *xkey, void *udata)
 		widget_root_keypress(xkey, widget);
 }
 
+/*
+ * Moves pending damage along with contents that were moved 'dy' pixels
+ * vertically e.g. with XCopyArea.
+ */
+void
+widget_scroll_damage(struct widget *widget, int dy)
+{
+	int i;
+
+	for (i = 0; i < widget->ndamage; i++) {
+		widget->damage[i].from_px += dy;
+		widget->damage[i].to_px += dy;
+	}
+}
+
 static void
 widget_flush_expose(struct widget *widget)
 {
-	int i;
+	struct damage damage[WIDGET_MAX_DAMAGE];
+	int i, ndamage;
 	int from, to;
 
 	if (widget->need_expose && widget->draw != NULL) {
-		from = MAX(widget->expose_from_px, 0);
-		to = MAX(widget->expose_to_px, 0);
-		from = MIN(from, widget->size[1]);
-		to = MIN(to, widget->size[1]);
+		ndamage = widget->ndamage;
+		memcpy(damage, widget->damage, ndamage * sizeof(*damage));
 
 		widget->need_expose = 0;
-		widget->expose_from_px = 0;
-		widget->expose_to_px = 0;
-
-		if (from != to) {
+		widget->ndamage = 0;
+
+		for (i = 0; i < ndamage; i++) {
+			from = MAX(damage[i].from_px, 0);
+			to = MAX(damage[i].to_px, 0);
+			from = MIN(from, widget->size[1]);
+			to = MIN(to, widget->size[1]);
+			if (from == to)
+				continue;
 #ifdef DEBUG
 			printf("\tDraw ");
 			widget_print_name(widget);
@@ -566,6 +653,17 @@ widget_set_motion_callback(struct widget *widget,
 	widget->motion_udata = udata;
 }
 
+/*
+ * Frame callback runs once per frame before the damage is drawn.
+ */
+void
+widget_set_frame_callback(struct widget *widget,
+	WidgetFrame frame, void *udata)
+{
+	widget->frame = frame;
+	widget->frame_udata = udata;
+}
+
 void
 widget_set_draw_callback(struct widget *widget, WidgetDraw draw, void *udata)
 {
@@ -780,6 +878,34 @@ widget_find_parent_window(struct widget *widget)
 	return widget;
 }
 
+/*
+ * Returns 1 if drawing into the widget could be seen i.e. the widget and
+ * its parents are shown, and it is not outside of its parent window.
+ */
+int
+widget_is_viewable(struct widget *widget)
+{
+	struct widget *parent;
+
+	if (widget->size[WIDTH_AXIS] <= 0 || widget->size[HEIGHT_AXIS] <= 0)
+		return 0;
+
+	for (parent = widget; parent != NULL; parent = parent->parent)
+		if (!parent->visible)
+			return 0;
+
+	if (widget->parent == NULL)
+		return 1;
+
+	parent = widget_find_parent_window(widget);
+	if (POSX(widget) >= WIDTH(parent) || POSY(widget) >= HEIGHT(parent) ||
+	    POSX(widget) + WIDTH(widget) <= 0 ||
+	    POSY(widget) + HEIGHT(widget) <= 0)
+		return 0;
+
+	return 1;
+}
+
 void
 widget_show(struct widget *widget)
 {
@@ -804,6 +930,7 @@ widget_show(struct widget *widget)
 	widget->old_pos[1] = 0;
 
 	widget->was_hidden = 1;
+	widget_update_prefer_tree(widget);
 	widget_update_geometry(widget);	
 	widget->was_hidden = 0;
 
@@ -974,12 +1101,81 @@ widget_root_idle(void *udata)
 	printf("widget_root_idle %s\n", widget->name);
 #endif
 
+	if (!widget_frame_due(widget))
+		return;
+
 	widget_flush_changes(widget);
+	widget_run_frame(widget);
 	widget_flush_expose(widget);
 
 	XFlush(DPY(dpy));
 }
 
+static void
+widget_run_frame(struct widget *widget)
+{
+	int i;
+
+	if (widget->frame != NULL)
+		widget->frame(widget->frame_udata);
+
+	for (i = 0; i < widget->nchildren; i++)
+		widget_run_frame(widget->children[i]);
+}
+
+/*
+ * Returns 1 if it is time to flush the next frame. Otherwise makes
+ * sure that the frame timer wakes us up when it is.
+ */
+static int
+widget_frame_due(struct widget *widget)
+{
+	struct timespec now;
+	long elapsed_ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed_ms = (now.tv_sec - widget->frame_last.tv_sec) * 1000 +
+	    (now.tv_nsec - widget->frame_last.tv_nsec) / 1000000;
+
+	if (widget->frame_urgent || elapsed_ms >= FRAME_INTERVAL_MS ||
+	    elapsed_ms < 0) {
+		widget->frame_urgent = 0;
+		widget->frame_last = now;
+		return 1;
+	}
+
+	if (widget->frame_timer == 0 &&
+	    (widget->frame_timer = add_timer(FRAME_INTERVAL_MS - elapsed_ms,
+	    widget_frame_timer, widget)) == -1)
+		err(1, "add_timer");
+	return 0;
+}
+
+/*
+ * The frame is flushed by the idle handler that runs next.
+ */
+static void
+widget_frame_timer(void *udata)
+{
+	struct widget *widget = udata;
+
+	widget->frame_timer = 0;
+}
+
+/*
+ * Returns the widget's own XftDraw for drawing text into its window.
+ */
+XftDraw *
+widget_ftdraw(struct widget *widget)
+{
+	assert(widget->window != 0);
+
+	if (widget->ftdraw == NULL)
+		widget->ftdraw = font_create_ftdraw(widget->window);
+
+	return widget->ftdraw;
+}
+
 void
 widget_free(struct widget *widget)
 {
@@ -988,8 +1184,11 @@ widget_free(struct widget *widget)
 	if (widget->window != 0)
 		remove_handlers_for_window(widget->window);
 
-	if (widget->parent == NULL)
+	if (widget->parent == NULL) {
 		remove_idle_handler(widget_root_idle, widget);
+		if (widget->frame_timer != 0)
+			cancel_timer(widget->frame_timer);
+	}
 
 	widget_hide(widget);
 
@@ -1014,7 +1213,8 @@ widget_free(struct widget *widget)
 	if (widget->focus == widget)
 		widget->focus = NULL;
 
-	font_destroy_ftdraw();
+	if (widget->ftdraw != NULL)
+		font_free_ftdraw(widget->ftdraw);
 
 	if (widget->window != 0)
 		XDestroyWindow(DPY(dpy), widget->window);
@@ -19,6 +19,9 @@
 #define WIDGET_H
 
 #include <X11/Xlib.h>
+#include <X11/Xft/Xft.h>
+
+#include <time.h>
 
 struct widget;
 
@@ -29,6 +32,7 @@ typedef int (*WidgetMotion)(XMotionEvent *, void *);
 typedef void (*WidgetFocusChange)(int, void *);
 typedef void (*WidgetUpdatePrefer)(void *);
 typedef void (*WidgetGeometry)(void *);
+typedef void (*WidgetFrame)(void *);
 
 #define WIDGET(_x) (_x)->widget
 #define WINDOW(_x) WIDGET((_x))->window
@@ -57,6 +61,17 @@ typedef void (*WidgetGeometry)(void *);
 #define PREFER_WIDTH(_x) (_x)->size[WIDTH_AXIS]
 #define PREFER_HEIGHT(_x) (_x)->size[HEIGHT_AXIS]
 
+/*
+ * How many separate damaged areas are tracked before the closest ones
+ * are merged together.
+ */
+#define WIDGET_MAX_DAMAGE 8
+
+struct damage {
+	int from_px;
+	int to_px;
+};
+
 struct widget {
 	Window window;
 
@@ -91,6 +106,9 @@ struct widget {
 	WidgetFocusChange focus_change;
 	void *focus_change_udata;
 
+	WidgetFrame frame;
+	void *frame_udata;
+
 	/*
 	 * Actual geometry of the widget.
 	 */
@@ -117,19 +135,39 @@ struct widget {
 
 	XIC ic;
 
+	/*
+	 * Created on first use by widget_ftdraw().
+	 */
+	XftDraw *ftdraw;
+
 	XWindowChanges changes;
 	unsigned int changes_mask;
 
 	int need_expose;
 	int need_expose_from_event;
-	int expose_from_px;
-	int expose_to_px;
+
+	/*
+	 * Pending redraw as sorted, disjoint pixel row intervals. One
+	 * extra slot is used while merging.
+	 */
+	struct damage damage[WIDGET_MAX_DAMAGE + 1];
+	int ndamage;
 
 	/*
 	 * These are only relevant in root widget:
 	 */
 	struct widget *focus;
 	XIM xim;
+
+	/*
+	 * Frame pacing: damage is flushed at most once per
+	 * FRAME_INTERVAL_MS unless something urgent like keyboard echo
+	 * is pending. 'frame_timer' is set while the deferred frame is
+	 * waited for.
+	 */
+	int frame_timer;
+	int frame_urgent;
+	struct timespec frame_last;
 };
 
 struct widget	*widget_create(const char *, struct widget *);
@@ -141,6 +179,9 @@ void		 widget_free(struct widget *);
 
 void		 widget_show(struct widget *);
 void		 widget_hide(struct widget *);
+int		 widget_is_viewable(struct widget *);
+
+XftDraw		*widget_ftdraw(struct widget *);
 
 struct widget	*widget_find_parent_with_window(struct widget *);
 struct widget	*widget_find_parent_window(struct widget *);
@@ -151,6 +192,8 @@ void		 widget_focus_prev(struct widget *, int);
 void		 widget_focus(struct widget *);
 
 void		 widget_update_geometry(struct widget *);
+void		 widget_damage(struct widget *, int, int);
+void		 widget_scroll_damage(struct widget *, int);
 
 void		 widget_move_after(struct widget *, struct widget *);
 
@@ -168,6 +211,8 @@ void		 widget_set_motion_callback(struct widget *,
 		    WidgetMotion, void *);
 void		 widget_set_focus_change_callback(struct widget *,
 		    WidgetFocusChange, void *);
+void		 widget_set_frame_callback(struct widget *,
+		    WidgetFrame, void *);
 
 #ifdef DEBUG
 void		 widget_print_name(struct widget *);
@@ -0,0 +1,195 @@
+/*
+ * vtsh - A mashup of virtual terminal and shell
+ * Copyright (c) 2022, Tommi Leino <namhas@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * wrapindex.c: Number of display lines for each buffer row when rows
+ * are soft-wrapped, kept in a Fenwick tree so that display line number
+ * of a row, and the row of a display line, are found in O(log n).
+ *
+ * Counts are remembered until the row is measured again, so after the
+ * wrap width changes the old counts serve as estimates for the rows
+ * that have not been looked at. Invalidating everything is O(1).
+ */
+
+#include "wrapindex.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <assert.h>
+#include <err.h>
+
+struct wrapnode {
+	size_t		 tree;
+	size_t		 lines;
+	unsigned int	 gen;
+};
+
+struct wrapindex {
+	struct wrapnode	*nodes;
+	size_t		 n;
+	size_t		 alloc;
+	unsigned int	 gen;
+};
+
+#define LOWBIT(_x) ((_x) & -(_x))
+
+struct wrapindex *
+wrapindex_create(void)
+{
+	struct wrapindex *wi;
+
+	if ((wi = calloc(1, sizeof(struct wrapindex))) == NULL)
+		return NULL;
+	wi->gen = 1;
+	return wi;
+}
+
+void
+wrapindex_free(struct wrapindex *wi)
+{
+	free(wi->nodes);
+	free(wi);
+}
+
+size_t
+wrapindex_rows(struct wrapindex *wi)
+{
+	return wi->n;
+}
+
+/*
+ * Fenwick tree node k only covers rows before k, so dropping rows from
+ * the end leaves the rest of the tree intact.
+ */
+void
+wrapindex_truncate(struct wrapindex *wi, size_t n)
+{
+	if (n < wi->n)
+		wi->n = n;
+}
+
+/*
+ * Adds row with 'lines' display lines. The count is not considered
+ * valid until it is set with wrapindex_set().
+ */
+void
+wrapindex_append(struct wrapindex *wi, size_t lines)
+{
+	struct wrapnode *node;
+	size_t k;
+
+	if (wi->n == wi->alloc)
+		if (grow_array((void **) &wi->nodes, sizeof(*wi->nodes),
+		    &wi->alloc) == -1)
+			err(1, "grow_array");
+
+	k = wi->n + 1;
+	node = &wi->nodes[wi->n];
+	node->lines = lines;
+	node->gen = 0;
+	node->tree = lines + wrapindex_prefix(wi, k - 1) -
+	    wrapindex_prefix(wi, k - LOWBIT(k));
+	wi->n++;
+}
+
+size_t
+wrapindex_get(struct wrapindex *wi, size_t row)
+{
+	assert(row < wi->n);
+	return wi->nodes[row].lines;
+}
+
+void
+wrapindex_set(struct wrapindex *wi, size_t row, size_t lines)
+{
+	size_t k, delta;
+
+	assert(row < wi->n);
+	wi->nodes[row].gen = wi->gen;
+	if (lines == wi->nodes[row].lines)
+		return;
+
+	/* Unsigned wrap-around takes care of negative deltas. */
+	delta = lines - wi->nodes[row].lines;
+	wi->nodes[row].lines = lines;
+	for (k = row + 1; k <= wi->n; k += LOWBIT(k))
+		wi->nodes[k - 1].tree += delta;
+}
+
+int
+wrapindex_is_valid(struct wrapindex *wi, size_t row)
+{
+	return row < wi->n && wi->nodes[row].gen == wi->gen;
+}
+
+void
+wrapindex_invalidate(struct wrapindex *wi)
+{
+	if (++wi->gen == 0)
+		wi->gen = 1;
+}
+
+void
+wrapindex_invalidate_row(struct wrapindex *wi, size_t row)
+{
+	if (row < wi->n)
+		wi->nodes[row].gen = 0;
+}
+
+/*
+ * Returns the number of display lines before 'row'.
+ */
+size_t
+wrapindex_prefix(struct wrapindex *wi, size_t row)
+{
+	size_t k, sum;
+
+	if (row > wi->n)
+		row = wi->n;
+
+	sum = 0;
+	for (k = row; k > 0; k -= LOWBIT(k))
+		sum += wi->nodes[k - 1].tree;
+	return sum;
+}
+
+/*
+ * Returns the row that has display line 'line', and which display line
+ * of the row it is in 'sub_out'. Past the last row, returns the row
+ * count and the remaining lines in 'sub_out'.
+ */
+size_t
+wrapindex_find(struct wrapindex *wi, size_t line, size_t *sub_out)
+{
+	size_t pos, step;
+
+	step = 1;
+	while (step * 2 <= wi->n)
+		step *= 2;
+
+	pos = 0;
+	for (; step > 0; step /= 2) {
+		if (pos + step <= wi->n &&
+		    wi->nodes[pos + step - 1].tree <= line) {
+			pos += step;
+			line -= wi->nodes[pos - 1].tree;
+		}
+	}
+
+	*sub_out = line;
+	return pos;
+}
@@ -0,0 +1,43 @@
+/*
+ * vtsh - A mashup of virtual terminal and shell
+ * Copyright (c) 2022, Tommi Leino <namhas@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef WRAPINDEX_H
+#define WRAPINDEX_H
+
+#include <stddef.h>
+
+struct wrapindex;
+
+struct wrapindex	*wrapindex_create(void);
+void			 wrapindex_free(struct wrapindex *);
+
+size_t			 wrapindex_rows(struct wrapindex *);
+void			 wrapindex_truncate(struct wrapindex *, size_t);
+void			 wrapindex_append(struct wrapindex *, size_t);
+
+size_t			 wrapindex_get(struct wrapindex *, size_t);
+void			 wrapindex_set(struct wrapindex *, size_t, size_t);
+int			 wrapindex_is_valid(struct wrapindex *, size_t);
+void			 wrapindex_invalidate(struct wrapindex *);
+void			 wrapindex_invalidate_row(struct wrapindex *, size_t);
+
+/* lines = wrapindex_prefix(wi, row) */
+size_t			 wrapindex_prefix(struct wrapindex *, size_t);
+/* row = wrapindex_find(wi, line, sub_out) */
+size_t			 wrapindex_find(struct wrapindex *, size_t, size_t *);
+
+#endif
@@ -21,6 +21,7 @@
 
 #include <assert.h>
 #include <string.h>
+#include <limits.h>
 
 typedef enum handler_type {
 	HANDLER_TYPE_KEYPRESS, HANDLER_TYPE_EXPOSE, HANDLER_TYPE_RESIZE,
@@ -48,6 +49,10 @@ static size_t n_handlers;
 static size_t max_handlers;
 
 static void	handle_xevent(XEvent *);
+static void	handle_expose(XEvent *);
+static void	compress_motion(XEvent *);
+static Bool	is_expose_for(Display *, XEvent *, XPointer);
+static int	add_expose_area(XEvent *, int *, int *, int *, int *);
 static void	run_xevent_handlers(XEvent *, HandlerType, Window);
 
 extern struct dpy *dpy;
@@ -228,19 +233,115 @@ run_xevent_handlers(XEvent *event, HandlerType type, Window window)
 	}
 }
 
+static Bool
+is_expose_for(Display *display, XEvent *event, XPointer arg)
+{
+	Window window = *(Window *) arg;
+
+	return (event->type == Expose &&
+	    event->xexpose.window == window) ||
+	    (event->type == GraphicsExpose &&
+	    event->xgraphicsexpose.drawable == window);
+}
+
+/*
+ * Grows the area from x1, y1 to x2, y2 to cover the exposed area, and
+ * returns the number of expose events that are still to follow.
+ */
+static int
+add_expose_area(XEvent *event, int *x1, int *y1, int *x2, int *y2)
+{
+	int x, y, width, height, count;
+
+	if (event->type == GraphicsExpose) {
+		x = event->xgraphicsexpose.x;
+		y = event->xgraphicsexpose.y;
+		width = event->xgraphicsexpose.width;
+		height = event->xgraphicsexpose.height;
+		count = event->xgraphicsexpose.count;
+	} else {
+		x = event->xexpose.x;
+		y = event->xexpose.y;
+		width = event->xexpose.width;
+		height = event->xexpose.height;
+		count = event->xexpose.count;
+	}
+
+	*x1 = MIN(*x1, x);
+	*y1 = MIN(*y1, y);
+	*x2 = MAX(*x2, x + width);
+	*y2 = MAX(*y2, y + height);
+	return count;
+}
+
+/*
+ * Expose events come in series where 'count' tells how many are still
+ * to follow for the same window, and uncovering a window may queue
+ * several series. Also the areas that could not be copied with
+ * XCopyArea come as GraphicsExpose events. All of them that are for
+ * the same window are combined and handlers are run just once.
+ */
+static void
+handle_expose(XEvent *event)
+{
+	XEvent next, combined;
+	Window window;
+	int x1, y1, x2, y2, count;
+
+	if (event->type == GraphicsExpose)
+		window = event->xgraphicsexpose.drawable;
+	else
+		window = event->xexpose.window;
+
+	x1 = y1 = INT_MAX;
+	x2 = y2 = INT_MIN;
+	count = add_expose_area(event, &x1, &y1, &x2, &y2);
+	while (count > 0) {
+		XIfEvent(DPY(dpy), &next, is_expose_for, (XPointer) &window);
+		count = add_expose_area(&next, &x1, &y1, &x2, &y2);
+	}
+	while (XCheckIfEvent(DPY(dpy), &next, is_expose_for,
+	    (XPointer) &window))
+		add_expose_area(&next, &x1, &y1, &x2, &y2);
+
+	memset(&combined, 0, sizeof(combined));
+	combined.xexpose.type = Expose;
+	combined.xexpose.display = DPY(dpy);
+	combined.xexpose.window = window;
+	combined.xexpose.x = x1;
+	combined.xexpose.y = y1;
+	combined.xexpose.width = x2 - x1;
+	combined.xexpose.height = y2 - y1;
+	combined.xexpose.count = 0;
+	run_xevent_handlers(&combined, HANDLER_TYPE_EXPOSE, window);
+}
+
+/*
+ * Skips over pointer motion events that are immediately followed by
+ * another one for the same window, so that only the latest position
+ * is handled. Events in between, like button release, stop this.
+ */
+static void
+compress_motion(XEvent *event)
+{
+	XEvent next;
+
+	while (XEventsQueued(DPY(dpy), QueuedAfterReading) > 0) {
+		XPeekEvent(DPY(dpy), &next);
+		if (next.type != MotionNotify ||
+		    next.xmotion.window != event->xmotion.window)
+			break;
+		XNextEvent(DPY(dpy), event);
+	}
+}
+
 static void
 handle_xevent(XEvent *event)
 {
 	switch (event->type) {
 	case Expose:
-		/*
-		 * TODO: Decide whether or not we want all expose events
-		 *       or just the last one.
-		 */
-		if (1 || event->xexpose.count == 0) {
-			run_xevent_handlers(event, HANDLER_TYPE_EXPOSE,
-			    event->xexpose.window);
-		}
+	case GraphicsExpose:
+		handle_expose(event);
 		break;
 	case ButtonPress:
 	case ButtonRelease:
@@ -248,6 +349,7 @@ handle_xevent(XEvent *event)
 		    event->xbutton.window);
 		break;
 	case MotionNotify:
+		compress_motion(event);
 		run_xevent_handlers(event, HANDLER_TYPE_MOTION,
 		    event->xmotion.window);
 		break;